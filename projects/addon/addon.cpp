@@ -1,19 +1,27 @@
 #include "stdafx.hpp"
 
+#include <chrono>
 #include <format>
 #include <sstream>
 #include <string>
+#include <vector>
 
 import addon;
 import config;
 import overlay;
 import parser;
+import stream;
+import trace;
 import utils;
 
+// Commands are answered on the render thread, so a burst of them must not hold up a frame too long.
+constexpr auto command_budget = std::chrono::milliseconds(1);
+
 static void on_init_effect_runtime(reshade::api::effect_runtime *runtime)
 {
 	runtime_data &data = runtime->create_private_data<runtime_data>();
 	data.config.load(runtime);
+	data.timeline.create(runtime->get_device(), runtime->get_command_queue());
 
 	auto id = !data.config.InstanceID.empty() ? data.config.InstanceID : std::to_string(GetCurrentProcessId());
 	auto pipe = std::format("\\\\.\\pipe\\reshade-streams\\{}", id);
@@ -36,6 +44,7 @@ static void on_reshade_reloaded_effects(reshade::api::effect_runtime *runtime)
 	runtime_data &data = runtime->get_private_data<runtime_data>();
 
 	// Previous data is invalidated by reload.
+	data.benchmark.reset();
 	data.streams.clear();
 
 	runtime->enumerate_texture_variables(nullptr, [&](reshade::api::effect_runtime *runtime, reshade::api::effect_texture_variable variable) {
@@ -54,7 +63,17 @@ static void on_reshade_reloaded_effects(reshade::api::effect_runtime *runtime)
 		// Strip prefix.
 		name.erase(0, data.config.StreamPrefix.size());
 
-		data.streams.emplace_back(variable, std::move(name));
+		// Streams converted by the shader describe their memory layout in an annotation.
+		char layout[32] = "";
+		size_t layout_size = sizeof(layout);
+		runtime->get_annotation_string_from_texture_variable(variable, "stream_layout", layout, &layout_size);
+
+		// Streams that have to stay in step, like the buffers of a dataset, name a group.
+		char group[64] = "";
+		size_t group_size = sizeof(group);
+		runtime->get_annotation_string_from_texture_variable(variable, "stream_group", group, &group_size);
+
+		data.streams.emplace_back(variable, std::move(name), layout, group);
 	});
 
 	for (auto &stream : data.streams)
@@ -70,21 +89,25 @@ static void on_reshade_finish_effects(reshade::api::effect_runtime *runtime, res
 
 	try
 	{
+		trace_scope tick_scope("pipe tick");
+
 		data.pipe_server.tick([&](std::string_view message, std::ostream &reply) {
 			log_debug("Received message: {}", message);
 
 			for (auto &tokens : tokenizer(message))
 			{
+				trace_scope command_scope("command", message);
+
 				try
 				{
-					run_command(data, tokens);
+					run_command(data, tokens, reply);
 				}
 				catch (std::exception &e)
 				{
 					reply << e.what() << std::endl;
 				}
 			}
-		});
+		}, command_budget);
 	}
 	catch (std::exception &e)
 	{
@@ -92,19 +115,34 @@ static void on_reshade_finish_effects(reshade::api::effect_runtime *runtime, res
 		// print_exception(e);
 	}
 
-	bool recording_streams = false;
+	// Same for all streams, so they stay in step.
+	const frame_stamp frame = { std::chrono::steady_clock::now(), data.frame_index++ };
+
+	const capture_mode mode = capture_mode_of(data);
+
+	std::vector<stream *> recording_streams;
 
 	for (auto &stream : data.streams)
 	{
-		if (!stream.update(runtime, data.recording, data.config))
-			continue;
+		if (stream.update(runtime, mode, data.config, data.timeline))
+			recording_streams.push_back(&stream);
+	}
 
-		recording_streams = true;
+	// One submission for all streams.
+	{
+		trace_scope record_scope("record frames");
+		stream::record_frames(runtime, data.timeline, recording_streams, frame);
 	}
+	std::erase_if(recording_streams, [](stream *s) { return !s->is_recording(); });
+
+	update_benchmark(data, recording_streams, frame.time);
 
-	if (data.recording && !recording_streams)
+	if (recording_streams.empty())
 	{
-		data.recording = false;
+		if (mode == capture_mode::record)
+			data.recording = false;
+		else if (mode == capture_mode::replay)
+			data.replay = false;
 	}
 }
 
@@ -5,22 +5,37 @@ module;
 #include <algorithm>
 #include <charconv>
 #include <format>
+#include <limits>
+#include <optional>
+#include <ostream>
+#include <span>
 #include <stdexcept>
+#include <string>
 #include <string_view>
 #include <vector>
 
 export module addon;
 
+import benchmark;
 import config;
 import stream;
 import pipe_server;
+import readback;
+import stats;
+import trace;
+import utils;
 
 export struct __declspec(uuid("d1ffba56-33cc-45a5-a53b-8e8723cf0143")) runtime_data
 {
+	copy_timeline timeline;  // outlives the streams' readback rings
 	std::vector<stream> streams;
 	config config;
 	pipe_server pipe_server;
 	bool recording = false;
+	bool replay = false;  // recording takes precedence while both are on
+	uint64_t frame_index = 0;  // shared by all streams, see frame_stamp
+	std::optional<benchmark_run> benchmark;  // records while running
+	std::string benchmark_report;  // of the last run
 };
 
 export struct command_error : std::runtime_error
@@ -76,6 +91,14 @@ void apply_streams(std::vector<stream> &streams, std::string_view name, auto f)
 	throw command_error(std::format("Stream '{}' not found", name));
 }
 
+export capture_mode capture_mode_of(const runtime_data &data)
+{
+	if (data.recording)
+		return capture_mode::record;
+
+	return data.replay ? capture_mode::replay : capture_mode::off;
+}
+
 bool parse_int(std::string_view str, int &out)
 {
 	auto first = str.data();
@@ -83,7 +106,51 @@ bool parse_int(std::string_view str, int &out)
 	return std::from_chars(first, last, out).ptr == last;
 }
 
-export void run_command(runtime_data &data, const std::vector<std::string_view> &tokens)
+benchmark_stream benchmark_view(stream &s)
+{
+	return { s.name, &s.stats(), s.counters() };
+}
+
+/// <summary>
+/// Count a frame of a running benchmark, and stop recording when it is done or recording stopped on its own.
+/// </summary>
+export void update_benchmark(runtime_data &data, std::span<stream *const> recording, benchmark_run::clock::time_point start)
+{
+	if (!data.benchmark)
+		return;
+
+	const auto end = benchmark_run::clock::now();
+
+	std::vector<benchmark_stream> measured;
+	for (stream *s : recording)
+		measured.push_back(benchmark_view(*s));
+
+	data.benchmark->add_frame(measured, start, end);
+
+	if (!data.benchmark->is_done() && data.recording)
+		return;
+
+	try
+	{
+		std::vector<benchmark_stream> streams;
+		for (stream &s : data.streams)
+			streams.push_back(benchmark_view(s));
+
+		data.benchmark_report = data.benchmark->finish(streams);
+		log_info("{}", data.benchmark_report);
+	}
+	catch (benchmark_error &e)
+	{
+		data.benchmark_report = e.what();
+		print_exception(e);
+	}
+
+	data.benchmark.reset();
+	data.recording = false;
+}
+
+// Commands that report something write it to <paramref name="reply"/>.
+export void run_command(runtime_data &data, const std::vector<std::string_view> &tokens, std::ostream &reply)
 {
 	auto &command = tokens.front();
 
@@ -129,6 +196,31 @@ export void run_command(runtime_data &data, const std::vector<std::string_view>
 		std::string args = join_args(tokens.begin() + 2, tokens.end());
 		apply_streams(data.streams, tokens[1], [&](stream &s) { s.ffmpeg_args = args; });
 	}
+	else if (command == "stream.conversion")
+	{
+		if (tokens.size() != 3 || (tokens[2] != "none" && tokens[2] != "nv12" && tokens[2] != "yuv420p" && tokens[2] != "gray16"))
+			throw command_error("Expected: stream.conversion <stream name>|* none|nv12|yuv420p|gray16");
+
+		std::string conversion(tokens[2]);
+		apply_streams(data.streams, tokens[1], [&](stream &s) { s.conversion = conversion; });
+	}
+	else if (command == "stream.framerate")
+	{
+		int framerate;
+
+		if (tokens.size() != 3 || !parse_int(tokens[2], framerate) || framerate < 0)
+			throw command_error("Expected: stream.framerate <stream name>|* <framerate>|0");
+
+		apply_streams(data.streams, tokens[1], [&](stream &s) { s.framerate = framerate; });
+	}
+	else if (command == "stream.group")
+	{
+		if (tokens.size() != 2 && tokens.size() != 3)
+			throw command_error("Expected: stream.group <stream name>|* [<group>]");
+
+		std::string group(tokens.size() == 3 ? tokens[2] : "");
+		apply_streams(data.streams, tokens[1], [&](stream &s) { s.group = group; });
+	}
 	else if (command == "recording")
 	{
 		if (tokens.size() != 2)
@@ -162,6 +254,132 @@ export void run_command(runtime_data &data, const std::vector<std::string_view>
 			throw command_error("Expected: recording start|end|toggle");
 		}
 	}
+	else if (command == "replay")
+	{
+		if (tokens.size() != 2)
+			throw command_error("Expected: replay start|end|toggle");
+
+		auto &arg = tokens[1];
+
+		if (arg == "start")
+		{
+			if (data.replay)
+				throw command_error("Already buffering replay");
+
+			if (std::none_of(data.streams.begin(), data.streams.end(), [](auto &s) { return s.selected; }))
+				throw command_error("No stream selected");
+
+			data.replay = true;
+		}
+		else if (arg == "end")
+		{
+			if (!data.replay)
+				throw command_error("Not buffering replay");
+
+			data.replay = false;
+		}
+		else if (arg == "toggle")
+		{
+			data.replay ^= true;
+		}
+		else
+		{
+			throw command_error("Expected: replay start|end|toggle");
+		}
+	}
+	else if (command == "replay.save")
+	{
+		int seconds = std::numeric_limits<int>::max();
+
+		if (tokens.size() > 2 || (tokens.size() == 2 && (!parse_int(tokens[1], seconds) || seconds <= 0)))
+			throw command_error("Expected: replay.save [<seconds>]");
+
+		size_t buffering = 0, failed = 0;
+
+		// One failing does not keep the others from being saved.
+		for (auto &stream : data.streams)
+		{
+			if (stream.mode() != capture_mode::replay)
+				continue;
+
+			buffering++;
+
+			try
+			{
+				stream.save_replay(seconds, data.config);
+			}
+			catch (stream_error &e)
+			{
+				print_exception(e);
+				reply << e.what() << std::endl;
+				failed++;
+			}
+		}
+
+		if (buffering == 0)
+			throw command_error("Not buffering replay");
+
+		if (failed != 0)
+			throw command_error(std::format("Could not save replay of {} of {} streams", failed, buffering));
+	}
+	else if (command == "stats")
+	{
+		if (tokens.size() == 2 && tokens[1] == "reset")
+		{
+			for (auto &stream : data.streams)
+				stream.stats().reset();
+		}
+		else if (tokens.size() == 1)
+		{
+			for (auto &stream : data.streams)
+				reply << stream.name << ":\n" << stream.stats().report();
+		}
+		else
+		{
+			throw command_error("Expected: stats [reset]");
+		}
+	}
+	else if (command == "benchmark")
+	{
+		int frames;
+
+		if (tokens.size() == 1)
+		{
+			reply << (data.benchmark ? data.benchmark->progress() : data.benchmark_report.empty() ? "No benchmark run yet." : data.benchmark_report) << std::endl;
+		}
+		else if ((tokens.size() == 2 || tokens.size() == 3) && parse_int(tokens[1], frames) && frames > 0)
+		{
+			if (data.recording || data.replay)
+				throw command_error("Already recording");
+
+			if (std::none_of(data.streams.begin(), data.streams.end(), [](auto &s) { return s.selected; }))
+				throw command_error("No stream selected");
+
+			data.benchmark.emplace(frames, std::string(tokens.size() == 3 ? tokens[2] : ""));
+			data.recording = true;
+		}
+		else
+		{
+			throw command_error("Expected: benchmark [<frames> [<results file>]]");
+		}
+	}
+	else if (command == "trace")
+	{
+		if (tokens.size() == 2 && tokens[1] == "start")
+		{
+			start_tracing();
+		}
+		else if (tokens.size() == 3 && tokens[1] == "stop")
+		{
+			std::string filename(tokens[2]);
+			size_t count = stop_tracing(filename);
+			reply << std::format("Wrote {} events to '{}'.", count, filename) << std::endl;
+		}
+		else
+		{
+			throw command_error("Expected: trace start|stop <file>");
+		}
+	}
 	else
 	{
 		throw command_error(std::format("Command '{}' not found", command));
@@ -0,0 +1,164 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+export module benchmark;
+
+import recording;
+import stats;
+
+export struct benchmark_error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+/// <summary>
+/// What a benchmark measures of a stream, taken from it by whoever drives the frames.
+/// </summary>
+export struct benchmark_stream
+{
+	std::string_view name;
+	pipeline_stats *stats;
+	recording_counters counters;
+};
+
+/// <summary>
+/// Measures what recording a number of frames costs the thread that produces them, along with each stream's
+/// throughput and drops. Knows nothing of where frames come from, so a game (see 'benchmark' command) and
+/// synthetic frames pushed into a recording are measured the same way.
+/// </summary>
+export class benchmark_run
+{
+public:
+	using clock = pipeline_stats::clock;
+
+private:
+	struct stream_start
+	{
+		std::string name;
+		recording_counters counters;  // when timing started
+	};
+
+	uint64_t _frames;
+	uint64_t _timed = 0;
+	std::string _results_file;
+	latency_histogram _render;  // per frame, from updating the streams to submitting their copies
+	std::vector<stream_start> _streams;
+	clock::time_point _start;
+	clock::time_point _end;
+
+public:
+	/// <summary>
+	/// Results are also appended as CSV rows to <paramref name="results_file"/>, if not empty, to compare runs.
+	/// </summary>
+	benchmark_run(uint64_t frames, std::string results_file) : _frames{ frames }, _results_file{ std::move(results_file) } {}
+
+	/// <summary>
+	/// Count a frame on the render thread from <paramref name="start"/> to <paramref name="end"/>, in which
+	/// <paramref name="recording"/> streams recorded.
+	/// </summary>
+	void add_frame(std::span<const benchmark_stream> recording, clock::time_point start, clock::time_point end);
+
+	bool is_done() const { return _timed >= _frames; }
+
+	std::string progress() const { return std::format("Benchmark running, {} of {} frames.", _timed, _frames); }
+
+	/// <summary>
+	/// Report the results, before the <paramref name="streams"/> stop recording.
+	/// </summary>
+	std::string finish(std::span<const benchmark_stream> streams);
+};
+
+void benchmark_run::add_frame(std::span<const benchmark_stream> recording, clock::time_point start, clock::time_point end)
+{
+	// Frames in which the recordings start or stop are not counted.
+	if (recording.empty())
+		return;
+
+	if (_streams.empty())
+	{
+		// Measure from here on, without the start of the recordings.
+		for (auto &s : recording)
+		{
+			s.stats->reset();
+			_streams.push_back({ std::string(s.name), s.counters });
+		}
+
+		_start = end;
+		return;
+	}
+
+	_render.add(uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()));
+	_timed++;
+	_end = end;
+}
+
+std::string benchmark_run::finish(std::span<const benchmark_stream> streams)
+{
+	if (_timed == 0)
+		throw benchmark_error("Benchmark ended before any frame was recorded.");
+
+	const double seconds = std::chrono::duration<double>(_end - _start).count();
+	const auto render = _render.summarize();
+
+	std::string report = std::format("Benchmark of {} frames in {:.1f} s, {:.1f} fps{}.\n", _timed, seconds, _timed / seconds,
+									 is_done() ? "" : ", ended early");
+	report += std::format("  render thread per frame: mean={:.1f} p50={:.1f} p99={:.1f} max={:.1f} us\n",
+						  render.mean / 1e3, render.p50 / 1e3, render.p99 / 1e3, render.max / 1e3);
+
+	std::string rows;
+
+	for (auto &start : _streams)
+	{
+		auto it = std::find_if(streams.begin(), streams.end(), [&](auto &s) { return s.name == start.name; });
+		if (it == streams.end())
+			continue;
+
+		const recording_counters &counters = it->counters;
+		const uint64_t queued = counters.queued - std::min(counters.queued, start.counters.queued);
+		const uint64_t dropped = counters.dropped - std::min(counters.dropped, start.counters.dropped);
+		const double throughput = it->stats->throughput() / 1e6;
+		const auto wait = it->stats->summarize(stage::wait);
+		const auto map = it->stats->summarize(stage::map);
+
+		report += std::format("{}: {} frames queued, {} dropped\n", start.name, queued, dropped);
+		report += it->stats->report();
+
+		rows += std::format("{:%F %T},{},{:.3f},{:.1f},{:.1f},{:.1f},{:.1f},{},{},{},{:.1f},{:.1f},{:.1f}\n",
+							std::chrono::floor<std::chrono::seconds>(std::chrono::system_clock::now()), _timed, seconds,
+							render.mean / 1e3, render.p50 / 1e3, render.p99 / 1e3, render.max / 1e3,
+							start.name, queued, dropped, throughput, wait.p99 / 1e3, map.p99 / 1e3);
+	}
+
+	if (!_results_file.empty())
+	{
+		std::error_code ignored;
+		const bool exists = std::filesystem::exists(_results_file, ignored);
+
+		std::ofstream file(_results_file, std::ios::binary | std::ios::app);
+
+		if (!exists)
+			file << "time,frames,seconds,render_mean_us,render_p50_us,render_p99_us,render_max_us,stream,queued,dropped,encoder_mb_s,wait_p99_us,map_p99_us\n";
+
+		file << rows;
+
+		// The report still stands.
+		if (!file)
+			log_warning("Could not write benchmark results to '{}'.", _results_file);
+	}
+
+	return report;
+}
@@ -65,6 +65,20 @@ public:
 		(std::string)(FFmpegPath)("ffmpeg"),
 		(std::string)(FFmpegArgs)("-c:v libx264 -preset ultrafast -crf 18"),
 		(int)(Framerate)(0),
+		(bool)(ConstantFramerate)(false),
+		(std::string)(Encoder)("ffmpeg"),
+		(int)(RawCompressionThreads)(4),
+		(int)(RawWriteDepth)(4),
+		(int)(ReadbackDepth)(3),
+		(int)(QueueSize)(8),
+		(std::string)(QueuePolicy)("block"),
+		(std::string)(ColorMatrix)("bt709"),
+		(std::string)(ColorRange)("limited"),
+		(std::string)(Transport)("pipe"),
+		(std::string)(RelayPath)("relay"),
+		(int)(PipeBufferFrames)(4),
+		(bool)(WarmEncoder)(false),
+		(int)(ReplayMemory)(1024),
 		(float)(OverlayListWidth)(180.0f),
 		(std::string)(InstanceID)(""),
 		(std::string)(StreamPrefix)("STREAM_")
@@ -85,4 +99,6 @@ public:
 	}
 
 	void reset() { *this = {}; }
+
+	bool operator==(const config &) const = default;
 };
@@ -0,0 +1,284 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string_view>
+
+export module frame_queue;
+
+import pixels;
+
+/// <summary>
+/// What to do with a new frame when the queue is full.
+/// </summary>
+export enum class queue_policy
+{
+	block,        // wait for the writer, stalls the game but keeps every frame
+	drop_newest,  // discard the new frame
+	drop_oldest,  // discard the oldest queued frame to make room
+};
+
+export std::optional<queue_policy> parse_queue_policy(std::string_view str)
+{
+	if (str == "block")
+		return queue_policy::block;
+	if (str == "drop-newest")
+		return queue_policy::drop_newest;
+	if (str == "drop-oldest")
+		return queue_policy::drop_oldest;
+	return std::nullopt;
+}
+
+/// <summary>
+/// Lock-free bounded queue handing frames from the render thread (single producer) to a writer thread (single consumer).
+/// Frames are copied into fixed-size slabs allocated up front and recycled, a running recording does not allocate.
+/// </summary>
+/// <remarks>
+/// The queue holds slab indices. Besides the queued ones, the producer owns at most one slab it is filling and the
+/// consumer at most one it is writing out, released slabs return to the producer through a second ring. So with
+/// capacity + 2 slabs, the producer always finds a free one. To drop the oldest frame, the producer takes it off the
+/// queue just like the consumer does, both claim the tail with compare-exchange.
+/// </remarks>
+export class frame_queue
+{
+private:
+	static constexpr uint32_t none = UINT32_MAX;
+
+	size_t _capacity;
+	size_t _slab_size;
+	size_t _slab_count;
+	queue_policy _policy;
+
+	std::unique_ptr<std::byte[]> _slabs;
+	std::unique_ptr<size_t[]> _sizes;
+	std::unique_ptr<uint32_t[]> _repeats;
+
+	// Queued slabs, producer advances head, either side advances tail.
+	std::unique_ptr<std::atomic<uint32_t>[]> _queue;
+	std::atomic<uint64_t> _head = 0;
+	std::atomic<uint64_t> _tail = 0;
+
+	// Slabs released by the consumer, producer advances tail.
+	std::unique_ptr<std::atomic<uint32_t>[]> _free;
+	std::atomic<uint64_t> _free_head = 0;
+	uint64_t _free_tail = 0;
+
+	uint32_t _producer_slab = none;
+	uint32_t _consumer_slab = none;
+
+	// Bumped to wake the other side, see std::atomic::wait.
+	std::atomic<uint32_t> _pushed_signal = 0;
+	std::atomic<uint32_t> _popped_signal = 0;
+	std::atomic<bool> _closed = false;
+
+	std::atomic<uint64_t> _queued = 0;
+	std::atomic<uint64_t> _dropped = 0;
+
+public:
+	frame_queue(size_t capacity, size_t slab_size, queue_policy policy);
+
+	// No copying or moving, threads hold references.
+	frame_queue(const frame_queue &) = delete;
+	frame_queue &operator=(const frame_queue &) = delete;
+
+	size_t slab_size() const { return _slab_size; }
+
+	/// <summary>
+	/// Copy a frame of <paramref name="rows"/> rows of <paramref name="row_size"/> bytes into the queue, packing the rows tightly.
+	/// <paramref name="repeat"/> is the number of video frames it stands for, see frame_pacer.
+	/// Returns false if the frame was not queued because it was dropped or the queue is closed.
+	/// </summary>
+	bool push(const void *data, size_t row_pitch, size_t row_size, size_t rows, uint32_t repeat = 1);
+
+	/// <summary>
+	/// Wait for the next frame, which stays valid until the next call. The previous frame's slab is recycled.
+	/// Returns false once the queue is closed and empty.
+	/// </summary>
+	bool pop(std::span<const std::byte> &frame, uint32_t &repeat);
+
+	/// <summary>
+	/// Wake up both sides. No more frames are accepted, queued ones can still be popped.
+	/// </summary>
+	void close();
+
+	bool is_closed() const { return _closed.load(); }
+
+	/// <summary>
+	/// Frames that can be pushed without being dropped, unlimited for queues that block instead.
+	/// </summary>
+	size_t room() const { return _policy == queue_policy::block ? SIZE_MAX : _capacity - std::min(size(), _capacity); }
+
+	/// <summary>
+	/// Count a frame dropped before it was pushed, e.g. along with frames of other streams.
+	/// </summary>
+	void drop() { _dropped.fetch_add(1, std::memory_order_relaxed); }
+
+	size_t size() const { return size_t(_head.load() - _tail.load()); }
+
+	uint64_t queued() const { return _queued.load(std::memory_order_relaxed); }
+
+	uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); }
+
+private:
+	std::byte *slab(uint32_t index) { return _slabs.get() + index * _slab_size; }
+
+	void wake(std::atomic<uint32_t> &signal)
+	{
+		signal.fetch_add(1);
+		signal.notify_all();
+	}
+
+	// Claim the oldest queued slab, or return none if the queue is empty.
+	uint32_t take_oldest();
+};
+
+frame_queue::frame_queue(size_t capacity, size_t slab_size, queue_policy policy)
+	: _capacity{ capacity != 0 ? capacity : 1 }, _slab_size{ slab_size }, _policy{ policy }
+{
+	_slab_count = _capacity + 2;
+
+	_slabs = std::make_unique_for_overwrite<std::byte[]>(_slab_count * _slab_size);
+	_sizes = std::make_unique<size_t[]>(_slab_count);
+	_repeats = std::make_unique<uint32_t[]>(_slab_count);
+	_queue = std::make_unique<std::atomic<uint32_t>[]>(_capacity);
+	_free = std::make_unique<std::atomic<uint32_t>[]>(_slab_count);
+
+	for (uint32_t i = 0; i < _slab_count; i++)
+		_free[i].store(i);
+
+	_free_head.store(_slab_count);
+}
+
+bool frame_queue::push(const void *data, size_t row_pitch, size_t row_size, size_t rows, uint32_t repeat)
+{
+	if (_closed.load())
+		return false;
+
+	size_t length = row_size * rows;
+
+	if (length > _slab_size || row_size > row_pitch)
+		throw std::length_error("Frame does not fit into queue slab.");
+
+	uint64_t head = _head.load(std::memory_order_relaxed);
+
+	if (_policy == queue_policy::drop_newest && head - _tail.load() >= _capacity)
+	{
+		_dropped.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	if (_producer_slab == none)
+	{
+		// Always available, see remarks.
+		assert(_free_tail != _free_head.load());
+		_producer_slab = _free[_free_tail % _slab_count].load();
+		_free_tail++;
+	}
+
+	copy_rows(slab(_producer_slab), row_size, data, row_pitch, row_size, rows);
+	_sizes[_producer_slab] = length;
+	_repeats[_producer_slab] = repeat;
+
+	// Only the consumer touched the queue since the check above, so it can only have more room.
+	while (head - _tail.load() >= _capacity)
+	{
+		if (_policy == queue_policy::drop_oldest)
+		{
+			uint32_t oldest = take_oldest();
+
+			if (oldest != none)
+			{
+				// The consumer releases slabs through the free ring only, so swap ownership here.
+				_dropped.fetch_add(1, std::memory_order_relaxed);
+				_queue[head % _capacity].store(_producer_slab);
+				_head.store(head + 1);
+				_producer_slab = oldest;
+				_queued.fetch_add(1, std::memory_order_relaxed);
+				wake(_pushed_signal);
+				return true;
+			}
+
+			// Consumer just took it, there is room now.
+			continue;
+		}
+
+		uint32_t signal = _popped_signal.load();
+
+		if (_closed.load())
+			return false;
+
+		if (head - _tail.load() >= _capacity)
+			_popped_signal.wait(signal);
+	}
+
+	_queue[head % _capacity].store(_producer_slab);
+	_head.store(head + 1);
+	_producer_slab = none;
+	_queued.fetch_add(1, std::memory_order_relaxed);
+	wake(_pushed_signal);
+
+	return true;
+}
+
+bool frame_queue::pop(std::span<const std::byte> &frame, uint32_t &repeat)
+{
+	if (_consumer_slab != none)
+	{
+		uint64_t free_head = _free_head.load(std::memory_order_relaxed);
+		_free[free_head % _slab_count].store(_consumer_slab);
+		_free_head.store(free_head + 1);
+		_consumer_slab = none;
+	}
+
+	while (true)
+	{
+		uint32_t signal = _pushed_signal.load();
+
+		uint32_t index = take_oldest();
+
+		if (index != none)
+		{
+			_consumer_slab = index;
+			frame = { slab(index), _sizes[index] };
+			repeat = _repeats[index];
+			wake(_popped_signal);
+			return true;
+		}
+
+		if (_closed.load())
+			return false;
+
+		_pushed_signal.wait(signal);
+	}
+}
+
+void frame_queue::close()
+{
+	_closed.store(true);
+	wake(_pushed_signal);
+	wake(_popped_signal);
+}
+
+uint32_t frame_queue::take_oldest()
+{
+	uint64_t tail = _tail.load();
+
+	while (tail != _head.load())
+	{
+		uint32_t index = _queue[tail % _capacity].load();
+
+		// Fails if the other side claimed it first, retry with updated tail.
+		if (_tail.compare_exchange_weak(tail, tail + 1))
+			return index;
+	}
+
+	return none;
+}
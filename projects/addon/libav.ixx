@@ -0,0 +1,352 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#ifdef STREAMS_LIBAV
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+}
+#endif
+
+export module libav;
+
+import parser;
+import recording;
+
+using std::string_view;
+
+export struct libav_error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+/// <summary>
+/// Whether the addon was built with FFmpeg's libraries, see 'FFmpegDir' in the project file.
+/// </summary>
+export constexpr bool libav_available =
+#ifdef STREAMS_LIBAV
+	true;
+#else
+	false;
+#endif
+
+/// <summary>
+/// Encode and mux in this process with libavcodec and libavformat, instead of running FFmpeg.
+/// The output options understand the subset of FFmpeg's arguments that concerns a single video encoder:
+/// '-c:v', '-pix_fmt', and options passed to the encoder like '-preset', '-crf' or '-b:v'.
+/// </summary>
+export std::unique_ptr<encoder> make_libav_encoder(string_view filename, const video_format &format, string_view output_options);
+
+#ifdef STREAMS_LIBAV
+
+template<typename T, void (*Free)(T **)>
+struct av_deleter
+{
+	void operator()(T *p) const { Free(&p); }
+};
+
+struct format_context_deleter
+{
+	void operator()(AVFormatContext *context) const
+	{
+		if (!(context->oformat->flags & AVFMT_NOFILE))
+			avio_closep(&context->pb);
+		avformat_free_context(context);
+	}
+};
+
+struct sws_context_deleter
+{
+	void operator()(SwsContext *context) const { sws_freeContext(context); }
+};
+
+void check(int result, string_view what)
+{
+	if (result < 0)
+	{
+		char message[AV_ERROR_MAX_STRING_SIZE] = {};
+		av_strerror(result, message, sizeof(message));
+		throw libav_error(std::format("{}: {}", what, message));
+	}
+}
+
+class libav_encoder : public encoder
+{
+private:
+	std::unique_ptr<AVFormatContext, format_context_deleter> _format;
+	std::unique_ptr<AVCodecContext, av_deleter<AVCodecContext, avcodec_free_context>> _codec;
+	std::unique_ptr<SwsContext, sws_context_deleter> _scaler;
+	std::unique_ptr<AVFrame, av_deleter<AVFrame, av_frame_free>> _input;
+	std::unique_ptr<AVFrame, av_deleter<AVFrame, av_frame_free>> _scaled;
+	std::unique_ptr<AVPacket, av_deleter<AVPacket, av_packet_free>> _packet;
+	AVStream *_stream = nullptr;
+	int64_t _pts = 0;
+	std::string _filename;
+
+public:
+	libav_encoder(string_view filename, const video_format &format, string_view output_options);
+
+	void write(std::span<const std::byte> frame, bool more) override;
+
+	void finish() override;
+
+	void rename(string_view filename) override;
+
+private:
+	// Send a frame, or nullptr to drain, and write out whatever packets are ready.
+	void encode(AVFrame *frame);
+};
+
+struct encoder_options
+{
+	std::string codec = "libx264";
+	std::string pixel_format;
+	AVDictionary *codec_options = nullptr;
+
+	~encoder_options() { av_dict_free(&codec_options); }
+};
+
+void parse_options(string_view output_options, encoder_options &options)
+{
+	for (const auto &tokens : tokenizer(output_options))
+	{
+		for (size_t i = 0; i < tokens.size(); i++)
+		{
+			string_view name = tokens[i];
+
+			// Only concern the container or other streams.
+			if (name == "-y" || name == "-an" || name == "-sn" || name == "-dn")
+				continue;
+
+			if (!name.starts_with('-') || i + 1 == tokens.size())
+			{
+				throw libav_error(std::format("Expected option and value, got '{}'.", name));
+			}
+
+			std::string value(tokens[++i]);
+
+			name.remove_prefix(1);
+			if (name.ends_with(":v"))
+				name.remove_suffix(2);
+
+			if (name == "c" || name == "codec" || name == "vcodec")
+				options.codec = value;
+			else if (name == "pix_fmt")
+				options.pixel_format = value;
+			else
+				av_dict_set(&options.codec_options, std::string(name).c_str(), value.c_str(), 0);
+		}
+	}
+}
+
+libav_encoder::libav_encoder(string_view filename, const video_format &format, string_view output_options)
+{
+	encoder_options options;
+	parse_options(output_options, options);
+
+	AVPixelFormat input_format = av_get_pix_fmt(std::string(format.pixel_format).c_str());
+	if (input_format == AV_PIX_FMT_NONE)
+	{
+		throw libav_error(std::format("Pixel format '{}' is not supported by this FFmpeg build.", format.pixel_format));
+	}
+
+	const AVCodec *codec = avcodec_find_encoder_by_name(options.codec.c_str());
+	if (codec == nullptr)
+	{
+		throw libav_error(std::format("Encoder '{}' not found.", options.codec));
+	}
+
+	_filename = filename;
+	const std::string &path = _filename;
+
+	AVFormatContext *format_context = nullptr;
+	check(avformat_alloc_output_context2(&format_context, nullptr, nullptr, path.c_str()), "Could not choose container format");
+	_format.reset(format_context);
+
+	_codec.reset(avcodec_alloc_context3(codec));
+	if (_codec == nullptr)
+	{
+		throw libav_error("Could not allocate encoder.");
+	}
+
+	// Same as FFmpeg's default for raw video without a rate.
+	const int framerate = format.framerate > 0 ? format.framerate : 25;
+
+	_codec->width = int(format.width);
+	_codec->height = int(format.height);
+	_codec->time_base = { 1, framerate };
+	_codec->framerate = { framerate, 1 };
+
+	if (!options.pixel_format.empty())
+		_codec->pix_fmt = av_get_pix_fmt(options.pixel_format.c_str());
+	else if (codec->pix_fmts != nullptr)
+		_codec->pix_fmt = avcodec_find_best_pix_fmt_of_list(codec->pix_fmts, input_format, 0, nullptr);
+	else
+		_codec->pix_fmt = input_format;
+
+	if (_codec->pix_fmt == AV_PIX_FMT_NONE)
+	{
+		throw libav_error(std::format("Unknown pixel format '{}'.", options.pixel_format));
+	}
+
+	if (!format.color_space.empty())
+	{
+		_codec->colorspace = AVColorSpace(av_color_space_from_name(std::string(format.color_space).c_str()));
+		_codec->color_range = format.color_range == "pc" ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+	}
+
+	if (_format->oformat->flags & AVFMT_GLOBALHEADER)
+		_codec->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+	if (_codec->pix_fmt != input_format)
+	{
+		_scaler.reset(sws_getContext(_codec->width, _codec->height, input_format,
+									 _codec->width, _codec->height, _codec->pix_fmt,
+									 SWS_BILINEAR, nullptr, nullptr, nullptr));
+		if (_scaler == nullptr)
+		{
+			throw libav_error(std::format("Cannot convert from {} to {}.", format.pixel_format, av_get_pix_fmt_name(_codec->pix_fmt)));
+		}
+
+		// Like the FFmpeg executable would, except with BT.709 instead of untagged BT.601.
+		const AVPixFmtDescriptor *input_desc = av_pix_fmt_desc_get(input_format);
+		const AVPixFmtDescriptor *output_desc = av_pix_fmt_desc_get(_codec->pix_fmt);
+
+		if ((input_desc->flags & AV_PIX_FMT_FLAG_RGB) && !(output_desc->flags & AV_PIX_FMT_FLAG_RGB))
+		{
+			const int *coefficients = sws_getCoefficients(SWS_CS_ITU709);
+			sws_setColorspaceDetails(_scaler.get(), coefficients, 1, coefficients, 0, 0, 1 << 16, 1 << 16);
+
+			_codec->colorspace = AVCOL_SPC_BT709;
+			_codec->color_range = AVCOL_RANGE_MPEG;
+		}
+
+		_scaled.reset(av_frame_alloc());
+		_scaled->format = _codec->pix_fmt;
+		_scaled->width = _codec->width;
+		_scaled->height = _codec->height;
+		check(av_frame_get_buffer(_scaled.get(), 0), "Could not allocate frame");
+	}
+
+	check(avcodec_open2(_codec.get(), codec, &options.codec_options), "Could not open encoder");
+
+	// Consumed options are removed.
+	const AVDictionaryEntry *unused = nullptr;
+	while ((unused = av_dict_get(options.codec_options, "", unused, AV_DICT_IGNORE_SUFFIX)) != nullptr)
+	{
+		log_warning("Encoder '{}' does not know option '{}', ignored.", options.codec, unused->key);
+	}
+
+	_stream = avformat_new_stream(_format.get(), nullptr);
+	if (_stream == nullptr)
+	{
+		throw libav_error("Could not add stream to output.");
+	}
+
+	_stream->time_base = _codec->time_base;
+	check(avcodec_parameters_from_context(_stream->codecpar, _codec.get()), "Could not set stream parameters");
+
+	if (!(_format->oformat->flags & AVFMT_NOFILE))
+		check(avio_open(&_format->pb, path.c_str(), AVIO_FLAG_WRITE), "Could not open output file");
+
+	check(avformat_write_header(_format.get(), nullptr), "Could not write header");
+
+	_input.reset(av_frame_alloc());
+	_input->format = input_format;
+	_input->width = _codec->width;
+	_input->height = _codec->height;
+
+	_packet.reset(av_packet_alloc());
+}
+
+void libav_encoder::write(std::span<const std::byte> frame, bool)
+{
+	const auto input_format = AVPixelFormat(_input->format);
+
+	if (size_t(av_image_get_buffer_size(input_format, _input->width, _input->height, 1)) != frame.size())
+	{
+		throw libav_error("Frame size does not match pixel format.");
+	}
+
+	// Points into the frame without taking a reference. The frame is reused once this returns, so 'avcodec_send_frame'
+	// copies it into a buffer of its own. Only frames converted by the scaler are passed by reference.
+	check(av_image_fill_arrays(_input->data, _input->linesize, reinterpret_cast<const uint8_t *>(frame.data()),
+							   input_format, _input->width, _input->height, 1), "Could not set up frame");
+
+	AVFrame *encoded = _input.get();
+
+	if (_scaler)
+	{
+		// The encoder may still reference the previous frame.
+		check(av_frame_make_writable(_scaled.get()), "Could not allocate frame");
+		sws_scale(_scaler.get(), _input->data, _input->linesize, 0, _input->height, _scaled->data, _scaled->linesize);
+		encoded = _scaled.get();
+	}
+
+	encoded->pts = _pts++;
+	encode(encoded);
+}
+
+void libav_encoder::finish()
+{
+	encode(nullptr);
+	check(av_write_trailer(_format.get()), "Could not write trailer");
+
+	if (!(_format->oformat->flags & AVFMT_NOFILE))
+		check(avio_closep(&_format->pb), "Could not close output file");
+}
+
+void libav_encoder::rename(string_view filename)
+{
+	std::string destination(filename);
+	move_file(_filename, destination);
+	_filename = destination;
+}
+
+void libav_encoder::encode(AVFrame *frame)
+{
+	check(avcodec_send_frame(_codec.get(), frame), "Could not encode frame");
+
+	while (true)
+	{
+		int result = avcodec_receive_packet(_codec.get(), _packet.get());
+
+		if (result == AVERROR(EAGAIN) || result == AVERROR_EOF)
+			break;
+
+		check(result, "Could not encode frame");
+
+		av_packet_rescale_ts(_packet.get(), _codec->time_base, _stream->time_base);
+		_packet->stream_index = _stream->index;
+
+		// Takes ownership of the packet's data and resets it.
+		check(av_interleaved_write_frame(_format.get(), _packet.get()), "Could not write packet");
+	}
+}
+
+std::unique_ptr<encoder> make_libav_encoder(string_view filename, const video_format &format, string_view output_options)
+{
+	return std::make_unique<libav_encoder>(filename, format, output_options);
+}
+
+#else
+
+std::unique_ptr<encoder> make_libav_encoder(string_view, const video_format &, string_view)
+{
+	throw libav_error("The addon was built without FFmpeg's libraries.");
+}
+
+#endif
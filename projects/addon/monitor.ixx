@@ -0,0 +1,185 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+export module monitor;
+
+/// <summary>
+/// The last values of a measurement, oldest overwritten first. Laid out for ImGui::PlotLines.
+/// </summary>
+export class rolling_series
+{
+private:
+	std::vector<float> _values;
+	size_t _next = 0;
+	size_t _size = 0;
+
+public:
+	explicit rolling_series(size_t capacity) : _values(std::max<size_t>(capacity, 1)) {}
+
+	void push(float value)
+	{
+		_values[_next] = value;
+		_next = (_next + 1) % _values.size();
+		_size = std::min(_size + 1, _values.size());
+	}
+
+	void clear()
+	{
+		_next = 0;
+		_size = 0;
+	}
+
+	bool empty() const { return _size == 0; }
+
+	size_t size() const { return _size; }
+
+	/// <summary>
+	/// Values in storage order, the oldest at offset().
+	/// </summary>
+	const float *data() const { return _values.data(); }
+
+	size_t offset() const { return _size < _values.size() ? 0 : _next; }
+
+	float last() const { return _size != 0 ? _values[(_next + _values.size() - 1) % _values.size()] : 0.0f; }
+
+	float max() const
+	{
+		return _size != 0 ? *std::max_element(_values.begin(), _values.begin() + _size) : 0.0f;
+	}
+};
+
+/// <summary>
+/// Encoding speed relative to real time from FFmpeg's progress output, e.g. "speed=1.23x", the last one in <paramref name="log"/>.
+/// </summary>
+export std::optional<double> parse_ffmpeg_speed(std::string_view log)
+{
+	for (size_t pos = log.rfind("speed="); pos != std::string_view::npos; pos = pos != 0 ? log.rfind("speed=", pos - 1) : std::string_view::npos)
+	{
+		std::string_view value = log.substr(pos + 6);
+		value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+
+		double speed;
+		auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), speed);
+
+		// FFmpeg writes "speed=N/A" before it knows.
+		if (error == std::errc() && end != value.data() + value.size() && *end == 'x')
+			return speed;
+	}
+
+	return std::nullopt;
+}
+
+/// <summary>
+/// Up to the last <paramref name="size"/> bytes of a file, empty if it cannot be read.
+/// </summary>
+export std::string read_file_tail(const std::string &filename, size_t size)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file)
+		return {};
+
+	file.seekg(0, std::ios::end);
+	const auto length = size_t(file.tellg());
+	const size_t count = std::min(length, size);
+
+	std::string tail(count, '\0');
+	file.seekg(length - count);
+	file.read(tail.data(), std::streamsize(count));
+	tail.resize(size_t(file.gcount()));
+
+	return tail;
+}
+
+/// <summary>
+/// Totals of a recording at one point in time, as counted since it started or since stats were reset.
+/// </summary>
+export struct monitor_totals
+{
+	uint64_t frames = 0;           // queued for the writer
+	uint64_t readbacks = 0;        // waits and maps
+	uint64_t readback_ns = 0;      // spent in them
+	uint64_t bytes = 0;            // sent to the encoder
+	uint64_t dropped = 0;
+	size_t queue_depth = 0;        // frames queued right now
+	std::optional<double> speed;   // reported by FFmpeg
+};
+
+/// <summary>
+/// Rates of a stream's recording over the last minute or so, for the overlay. Sampled at a fixed interval
+/// from totals, so it does not depend on how often the overlay is drawn.
+/// </summary>
+export class stream_monitor
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	static constexpr std::chrono::milliseconds interval{ 250 };
+	static constexpr size_t history = 240;
+
+	rolling_series fps{ history };
+	rolling_series readback_ms{ history };  // mean per frame
+	rolling_series queue_depth{ history };
+	rolling_series dropped{ history };      // per second
+	rolling_series encoder_mbps{ history };
+	rolling_series speed{ history };        // only while FFmpeg reports it
+
+private:
+	std::optional<clock::time_point> _last_time;
+	monitor_totals _last;
+
+public:
+	bool is_due(clock::time_point now) const { return !_last_time || now - *_last_time >= interval; }
+
+	/// <summary>
+	/// Add a sample from <paramref name="totals"/>. Totals that went down, because stats were reset, count from zero.
+	/// </summary>
+	void sample(clock::time_point now, const monitor_totals &totals);
+
+	void clear();
+};
+
+void stream_monitor::sample(clock::time_point now, const monitor_totals &totals)
+{
+	if (_last_time)
+	{
+		const double seconds = std::chrono::duration<double>(now - *_last_time).count();
+
+		auto delta = [](uint64_t current, uint64_t last) { return current >= last ? current - last : current; };
+
+		const uint64_t frames = delta(totals.frames, _last.frames);
+		const uint64_t readbacks = delta(totals.readbacks, _last.readbacks);
+		const uint64_t readback_ns = delta(totals.readback_ns, _last.readback_ns);
+
+		fps.push(float(frames / seconds));
+		readback_ms.push(readbacks != 0 ? float(readback_ns / 1e6 / readbacks) : 0.0f);
+		queue_depth.push(float(totals.queue_depth));
+		dropped.push(float(delta(totals.dropped, _last.dropped) / seconds));
+		encoder_mbps.push(float(delta(totals.bytes, _last.bytes) / 1e6 / seconds));
+
+		if (totals.speed)
+			speed.push(float(*totals.speed));
+	}
+
+	_last_time = now;
+	_last = totals;
+}
+
+void stream_monitor::clear()
+{
+	for (auto *series : { &fps, &readback_ms, &queue_depth, &dropped, &encoder_mbps, &speed })
+		series->clear();
+
+	_last_time.reset();
+	_last = {};
+}
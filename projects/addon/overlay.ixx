@@ -6,12 +6,21 @@ module;
 
 #include <algorithm>
 #include <cinttypes>
+#include <cstdio>
+#include <initializer_list>
+#include <limits>
+#include <string>
 
 export module overlay;
 
 import addon;
 import config;
+import libav;
+import monitor;
+import rawvideo;
+import recording;
 import stream;
+import utils;
 
 template<typename... Args>
 void tooltip(const char *fmt, Args... args)
@@ -22,6 +31,19 @@ void tooltip(const char *fmt, Args... args)
 	}
 }
 
+void combo(const char *label, std::string &value, std::initializer_list<const char *> items)
+{
+	if (ImGui::BeginCombo(label, value.c_str()))
+	{
+		for (const char *item : items)
+		{
+			if (ImGui::Selectable(item, value == item))
+				value = item;
+		}
+		ImGui::EndCombo();
+	}
+}
+
 export void draw_settings_overlay(reshade::api::effect_runtime *runtime)
 {
 	runtime_data &data = runtime->get_private_data<runtime_data>();
@@ -30,8 +52,42 @@ export void draw_settings_overlay(reshade::api::effect_runtime *runtime)
 	tooltip("Only variables named with this prefix will be listed as streams. Change requires reloading effects.");
 	ImGui::InputText("FFmpeg Path", &data.config.FFmpegPath);
 	tooltip("Path to FFmpeg executable. Can be absolute, relative, or just filename (to search PATH).");
+	combo("Encoder", data.config.Encoder, { "ffmpeg", "libav", "raw" });
+	tooltip("Run the FFmpeg executable, or encode inside the game with FFmpeg's libraries (%s), "
+			"or store frames as they are into a .rawvideo file, to encode later with rawconvert. "
+			"The libraries understand only the video encoder options of FFmpeg Args. Applies to new recordings.",
+			libav_available ? "available" : "not in this build");
+	ImGui::SliderInt("Raw Compression Threads", &data.config.RawCompressionThreads, 0, 16);
+	tooltip("Threads compressing raw captures with LZ4 (%s), 0 to store frames uncompressed. Applies to new recordings.",
+			rawvideo_compression_available ? "available" : "not in this build");
+	ImGui::SliderInt("Raw Write Depth", &data.config.RawWriteDepth, 0, 16);
+	tooltip("Writes of 4 MiB in flight for raw captures, bypassing the system cache. 0 writes through the cache one at a time. Applies to new recordings.");
 	ImGui::InputTextWithHint("Instance ID", std::to_string(GetCurrentProcessId()).c_str(), &data.config.InstanceID);
 	tooltip("Used to control the addon remotely. Leave blank to copy process ID.");
+	ImGui::Checkbox("Constant Framerate", &data.config.ConstantFramerate);
+	tooltip("Pick frames by time at the recording framerate, repeating frames when the game is slower, so videos play back in real time. "
+			"Frames that are not needed are not copied. Needs a framerate. Applies to new recordings.");
+	ImGui::SliderInt("Readback Depth", &data.config.ReadbackDepth, 1, 8);
+	tooltip("Number of frames copied ahead of reading them back. Higher values stall the game less, but use more memory. Applies to new recordings.");
+	ImGui::SliderInt("Queue Size", &data.config.QueueSize, 1, 64);
+	tooltip("Number of frames buffered for FFmpeg per stream. Applies to new recordings.");
+	combo("Queue Policy", data.config.QueuePolicy, { "block", "drop-newest", "drop-oldest" });
+	tooltip("What to do when FFmpeg cannot keep up and the queue is full: stall the game, or drop frames.");
+	combo("Color Matrix", data.config.ColorMatrix, { "bt709", "bt601" });
+	tooltip("Used by streams converted to YUV.");
+	combo("Color Range", data.config.ColorRange, { "limited", "full" });
+	tooltip("Used by streams converted to YUV.");
+	ImGui::SliderInt("Pipe Buffer Frames", &data.config.PipeBufferFrames, 0, 16);
+	tooltip("Size of the pipe to FFmpeg in frames, 0 for the small system default. Applies to new recordings.");
+	combo("Transport", data.config.Transport, { "pipe", "shared-memory" });
+	tooltip("How frames get to FFmpeg. With shared memory, the relay program feeds FFmpeg, so the game does not wait on the pipe. Applies to new recordings.");
+	ImGui::InputText("Relay Path", &data.config.RelayPath);
+	tooltip("Path to the relay executable used by the shared memory transport. Can be absolute, relative, or just filename (to search PATH).");
+	ImGui::SliderInt("Replay Memory", &data.config.ReplayMemory, 64, 16384, "%d MiB");
+	tooltip("Memory for the replay buffer of each stream, which holds the last frames as sent to the encoder. Applies to new replay buffers.");
+	ImGui::Checkbox("Warm Encoder", &data.config.WarmEncoder);
+	tooltip("Keep an encoder started for each selected stream, so recording starts without waiting for FFmpeg. "
+			"It writes to a temporary file, renamed when the recording stops.");
 
 	ImGui::Spacing();
 
@@ -40,6 +96,58 @@ export void draw_settings_overlay(reshade::api::effect_runtime *runtime)
 	}
 }
 
+void plot(const char *label, const rolling_series &series, const char *format, float scale_min = 0.0f)
+{
+	if (series.empty())
+		return;
+
+	char overlay[64];
+	std::snprintf(overlay, sizeof(overlay), format, series.last());
+
+	// Scaled to the largest value shown, so small changes stay visible.
+	ImGui::PlotLines(label, series.data(), int(series.size()), int(series.offset()), overlay,
+					 0.0f, std::max(series.max() * 1.1f, scale_min), { ImGui::GetContentRegionAvail().x * 0.7f, 40.0f });
+}
+
+void draw_performance(const stream &stream)
+{
+	const stream_monitor &monitor = stream.monitor();
+	if (monitor.fps.empty())
+		return;
+
+	ImGui::Separator();
+	ImGui::Text("Performance");
+
+	const bool dropping = monitor.dropped.last() > 0.0f;
+	const bool slow = !monitor.speed.empty() && monitor.speed.last() < 0.98f;
+
+	if (stream.is_recording() && (dropping || slow))
+	{
+		ImGui::SameLine();
+		ImGui::TextColored({ 1.0f, 0.0f, 0.0f, 1.0f }, "%s", dropping ? "dropping frames" : "encoder falling behind");
+	}
+
+	plot("Capture", monitor.fps, "%.1f fps", 1.0f);
+	tooltip("Frames queued for the encoder per second.");
+
+	plot("Readback", monitor.readback_ms, "%.2f ms", 1.0f);
+	tooltip("Time to wait for and map each frame copied from the GPU.");
+
+	plot("Queue", monitor.queue_depth, "%.0f frames", 1.0f);
+	tooltip("Frames waiting for the encoder. A queue that keeps growing means the encoder cannot keep up.");
+
+	plot("Dropped", monitor.dropped, "%.1f/s", 1.0f);
+	tooltip("Frames dropped per second because the queue was full.");
+
+	plot("Encoder", monitor.encoder_mbps, "%.1f MB/s", 1.0f);
+	tooltip("Bytes sent to the encoder per second.");
+
+	plot("Speed", monitor.speed, "%.2fx", 1.5f);
+	tooltip("Encoding speed reported by FFmpeg, relative to real time. Below 1x, frames pile up in the queue.");
+
+	ImGui::Separator();
+}
+
 void draw_stream_details(reshade::api::effect_runtime *runtime, stream &stream)
 {
 	reshade::api::device *device = runtime->get_device();
@@ -64,7 +172,15 @@ void draw_stream_details(reshade::api::effect_runtime *runtime, stream &stream)
 	if (!pix_fmt)
 		pix_fmt = "unsupported pixel format";
 
-	ImGui::Text("%" PRIu32 "x%" PRIu32, desc.texture.width, desc.texture.height);
+	// Planes stacked in one texture, see 'stream_layout' annotation.
+	uint32_t video_height = desc.texture.height;
+	if (!stream.layout.empty())
+	{
+		pix_fmt = stream.layout.c_str();
+		video_height = desc.texture.height / 3 * 2;
+	}
+
+	ImGui::Text("%" PRIu32 "x%" PRIu32, desc.texture.width, video_height);
 	ImGui::SameLine(ImGui::GetContentRegionAvail().x - ImGui::CalcTextSize(pix_fmt).x);  // right align
 	ImGui::Text("%s", pix_fmt);
 
@@ -73,6 +189,27 @@ void draw_stream_details(reshade::api::effect_runtime *runtime, stream &stream)
 	ImGui::InputTextWithHint(extra_args_label, "additional FFmpeg arguments", &stream.ffmpeg_args);
 	ImGui::PopItemWidth();
 
+	constexpr auto conversion_label = "Conversion";
+	ImGui::PushItemWidth(std::max(ImGui::GetContentRegionAvail().x - ImGui::CalcTextSize(conversion_label).x - 10.0f, 1.0f));
+	combo(conversion_label, stream.conversion, { "none", "nv12", "yuv420p", "gray16" });
+	ImGui::PopItemWidth();
+	tooltip("Convert before sending to FFmpeg. YUV is for 8-bit color streams, not for data packed into color like depth. Gray16 is for 32-bit float streams.");
+
+	constexpr auto framerate_label = "Framerate";
+	ImGui::PushItemWidth(std::max(ImGui::GetContentRegionAvail().x - ImGui::CalcTextSize(framerate_label).x - 10.0f, 1.0f));
+	ImGui::DragInt(framerate_label, &stream.framerate, 1.0f, 0, std::numeric_limits<int>::max(), stream.framerate == 0 ? "same" : "%d");
+	ImGui::PopItemWidth();
+	tooltip("Record this stream at a lower framerate, 0 for the same as the others. Without constant framerate, it must divide the framerate. Applies to new recordings.");
+
+	constexpr auto group_label = "Group";
+	ImGui::PushItemWidth(std::max(ImGui::GetContentRegionAvail().x - ImGui::CalcTextSize(group_label).x - 10.0f, 1.0f));
+	ImGui::InputTextWithHint(group_label, "none", &stream.group);
+	ImGui::PopItemWidth();
+	tooltip("Streams in the same group record the same game frames, drop frames together, and stop together, "
+			"so their videos stay aligned. They must record at the same framerate.");
+
+	draw_performance(stream);
+
 	if (expanded) {
 		const float aspect_ratio = float(desc.texture.width) / float(desc.texture.height);
 		float width = ImGui::GetContentRegionAvail().x;
@@ -104,6 +241,37 @@ export void draw_overlay(reshade::api::effect_runtime *runtime)
 		data.recording ^= ImGui::Button(label.c_str(), { ImGui::GetContentRegionAvail().x, 0 });
 	}
 
+	if (data.replay || selected_count != 0)
+	{
+		const float half = (ImGui::GetContentRegionAvail().x - ImGui::GetStyle().ItemSpacing.x) / 2;
+
+		data.replay ^= ImGui::Button(data.replay ? "Stop Replay Buffer" : "Start Replay Buffer", { half, 0 });
+		tooltip("Keep the last frames of the selected streams in memory, up to Replay Memory in the settings. Recording pauses it.");
+
+		ImGui::SameLine();
+
+		ImGui::BeginDisabled(!data.replay);
+		if (ImGui::Button("Save Replay", { half, 0 }))
+		{
+			for (auto &stream : data.streams)
+			{
+				if (stream.mode() != capture_mode::replay)
+					continue;
+
+				try
+				{
+					stream.save_replay(std::numeric_limits<double>::infinity(), data.config);
+				}
+				catch (stream_error &e)
+				{
+					print_exception(e);
+				}
+			}
+		}
+		tooltip("Encode everything in the replay buffer to new files, named after the time.");
+		ImGui::EndDisabled();
+	}
+
 	float left = std::max(ImGui::GetContentRegionAvail().x - 220.f, 1.0f);
 	float right = -70.0f;
 	float gap = 15.0f;
@@ -142,6 +310,13 @@ export void draw_overlay(reshade::api::effect_runtime *runtime)
 	for (auto &stream : data.streams)
 	{
 		ImGui::Checkbox(stream.name.c_str(), &stream.selected);
+
+		// Starting and finalizing happen in the background.
+		if (recording_state state = stream.state(); state != recording_state::idle)
+		{
+			ImGui::SameLine();
+			ImGui::TextDisabled("%s", stream.mode() == capture_mode::replay && state == recording_state::running ? "replay" : to_string(state));
+		}
 	}
 
 	ImGui::EndChild();
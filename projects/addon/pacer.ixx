@@ -0,0 +1,53 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+
+export module pacer;
+
+/// <summary>
+/// Samples rendered frames against a clock running at the output framerate, for constant framerate video
+/// that plays back in real time whatever the game's framerate.
+/// </summary>
+export class frame_pacer
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+private:
+	std::chrono::duration<double> _interval;
+	std::optional<clock::time_point> _start;
+	uint64_t _emitted = 0;  // output frames so far
+
+public:
+	explicit frame_pacer(int framerate) : _interval{ 1.0 / framerate } {}
+
+	/// <summary>
+	/// Number of output frames the frame rendered at <paramref name="time"/> stands for:
+	/// 0 if it is not needed, more than 1 if the game fell behind and it has to be repeated.
+	/// The first frame starts the clock.
+	/// </summary>
+	uint32_t advance(clock::time_point time);
+};
+
+uint32_t frame_pacer::advance(clock::time_point time)
+{
+	if (!_start)
+		_start = time;
+
+	// A frame covers every output frame whose time is nearer to it than to the frame before or after.
+	const double position = (time - *_start) / _interval;
+	const uint64_t due = uint64_t(std::floor(position + 0.5)) + 1;
+
+	if (due <= _emitted)
+		return 0;
+
+	const uint64_t count = due - _emitted;
+	_emitted = due;
+
+	return count > UINT32_MAX ? UINT32_MAX : uint32_t(count);
+}
@@ -4,16 +4,23 @@ module;
 
 #include <Windows.h>
 
+#include <atomic>
+#include <chrono>
 #include <concepts>
 #include <sstream>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <vector>
 
 export module pipe_server;
 
+import trace;
 import winutils;
 
+// Channels are served by a thread of the server, which reads messages and passes them to the render thread.
+// A channel waits for its answer before it reads the next message, so each has at most one message passed on.
+
 class channel
 {
 private:
@@ -31,11 +38,13 @@ private:
 
 	std::string _read_buffer;
 	std::stringstream _write_buffer;
+	std::chrono::steady_clock::time_point _received_at;
 
 	enum class state {
 		CONNECTING,
 		WAITING,
 		READING,
+		RESPONDING,  // message passed on, the event is set once answered
 		WRITING,
 	} _state = state::CONNECTING;
 
@@ -68,43 +77,96 @@ public:
 
 	HANDLE event() const { return _overlapped->hEvent; }
 
-	template<typename T>
-	void resume(T &responder) requires std::invocable<T, std::string_view, std::stringstream &>
+	/// <summary>
+	/// Continue after the event was set, on the server's thread. Returns true when a message was read,
+	/// to be answered with respond().
+	/// </summary>
+	bool resume()
 	{
-		DWORD transferred;
-		auto res = win::res::GetOverlappedResult(_pipe, _overlapped.get(), &transferred, FALSE);
-
-		switch (res.err())
+		if (_state == state::RESPONDING)
 		{
-		case ERROR_SUCCESS:
-		case ERROR_MORE_DATA:
-			break;
-		case ERROR_BROKEN_PIPE:
-			if (!reconnect()) return;
-			_state = state::CONNECTING;
-			break;
-		default:
-			throw res.make_error();
+			// Answered, the event was set by respond().
+			if (!write()) return false;
+		}
+		else
+		{
+			DWORD transferred;
+			auto res = win::res::GetOverlappedResult(_pipe, _overlapped.get(), &transferred, FALSE);
+
+			switch (res.err())
+			{
+			case ERROR_SUCCESS:
+			case ERROR_MORE_DATA:
+				break;
+			case ERROR_BROKEN_PIPE:
+				if (!reconnect()) return false;
+				_state = state::CONNECTING;
+				break;
+			default:
+				throw res.make_error();
+			}
 		}
 
 		switch (_state)
 		{
-			while (true)
-			{
 		case state::CONNECTING:
 		case state::WRITING:
-			if (!wait()) return;
+			if (!wait()) return false;
 
 		case state::WAITING:
-			if (!read()) return;
+			if (!read()) return false;
 
 		case state::READING:
-			_write_buffer.seekg(0);
-			_write_buffer.seekp(0);
+			// No I/O until answered, so the event stays reset until respond() sets it.
+			_state = state::RESPONDING;
+			_received_at = std::chrono::steady_clock::now();
+			win::ResetEvent(_overlapped->hEvent);
+			return true;
+
+		default:
+			return false;
+		}
+	}
+
+	/// <summary>
+	/// Answer the message read last, on the render thread.
+	/// </summary>
+	template<typename T>
+	void respond(T &responder) requires std::invocable<T, std::string_view, std::stringstream &>
+	{
+		trace_event("command wait", _received_at, std::chrono::steady_clock::now());
+
+		_write_buffer.seekg(0);
+		_write_buffer.seekp(0);
+
+		try
+		{
 			responder(_read_buffer, _write_buffer);
-			if (!write()) return;
+		}
+		catch (std::exception &)
+		{
+			// Whatever was written is the answer, the channel must go on.
+			win::SetEvent(_overlapped->hEvent);
+			throw;
+		}
 
-			}
+		win::SetEvent(_overlapped->hEvent);
+	}
+
+	/// <summary>
+	/// Start over with a new client after an error.
+	/// </summary>
+	void restart() noexcept
+	{
+		try
+		{
+			if (reconnect())
+				win::SetEvent(_overlapped->hEvent);
+		}
+		catch (std::exception &)
+		{
+			// Broken for good, keep its event from waking the server.
+			ResetEvent(_overlapped->hEvent);
 		}
 	}
 
@@ -216,56 +278,125 @@ export struct pipe_server_error : std::runtime_error
 	using std::runtime_error::runtime_error;
 };
 
+/// <summary>
+/// Named pipe server with its own thread for the pipe I/O. Messages it read are answered on the render thread by tick().
+/// </summary>
 export class pipe_server {
 private:
 	std::vector<channel> _pipes;
-	std::vector<HANDLE> _events;
+	std::vector<HANDLE> _events;  // of the channels, then the stop event
+	win::unique_data<HANDLE, CloseHandle, INVALID_HANDLE_VALUE> _stop;
+	std::thread _thread;
+
+	// Channels with a message to answer, in the order they were read. A channel is in here at most once,
+	// so as many slots as channels never overflow. Written by the server's thread, read by tick().
+	std::vector<size_t> _received;
+	std::atomic<size_t> _received_head = 0;
+	size_t _received_tail = 0;
 
 public:
+	~pipe_server() { shutdown(); }
+
 	void listen(const char *pipe_name, int instances)
 	{
 		for (int i = 0; i < instances; i++) {
 			_pipes.emplace_back(pipe_name, instances);
 			_events.push_back(_pipes.back().event());
 		}
+
+		_stop = win::CreateEventA(NULL, TRUE, FALSE, NULL);
+		_events.push_back(_stop);
+
+		_received.resize(_pipes.size());
+
+		_thread = std::thread([this]() { serve(); });
 	}
 
 	void shutdown()
 	{
+		if (_thread.joinable())
+		{
+			win::SetEvent(_stop);
+			_thread.join();
+		}
+
 		_pipes.clear();
 		_events.clear();
+		_received.clear();
+		_received_head = 0;
+		_received_tail = 0;
 	}
 
+	/// <summary>
+	/// Answer messages in the order they arrived, until there are none or <paramref name="budget"/> is spent.
+	/// A message is always answered as a whole, so a slow one may go over. Returns whether any message was answered.
+	/// </summary>
 	template<typename T>
-	bool tick(T responder)
+	bool tick(T responder, std::chrono::steady_clock::duration budget)
 	{
-		try
-		{
-			// Check for new events.
-			auto wait = win::WaitForMultipleObjects(_events.size(), _events.data(), FALSE, 0);
+		const auto start = std::chrono::steady_clock::now();
+		bool answered = false;
 
-			if (wait == WAIT_TIMEOUT) {
-				// No new events.
-				return false;
-			}
-
-			auto &pipe = _pipes[wait - WAIT_OBJECT_0];
+		while (_received_tail != _received_head.load(std::memory_order_acquire))
+		{
+			auto &pipe = _pipes[_received[_received_tail % _received.size()]];
+			_received_tail++;
+			answered = true;
 
 			try
 			{
-				pipe.resume(responder);
+				pipe.respond(responder);
 			}
 			catch (std::exception &)
 			{
-				pipe.reconnect();
-				throw;
+				std::throw_with_nested(pipe_server_error("Could not process incoming message."));
 			}
 
-			return true;
+			if (std::chrono::steady_clock::now() - start >= budget)
+				break;
 		}
-		catch (std::exception &e)
+
+		return answered;
+	}
+
+private:
+	void serve()
+	{
+		const DWORD stop = DWORD(_pipes.size());
+
+		while (true)
 		{
-			std::throw_with_nested(pipe_server_error("Could not process incoming message."));
+			auto wait = WaitForMultipleObjects(DWORD(_events.size()), _events.data(), FALSE, INFINITE);
+
+			if (wait == WAIT_OBJECT_0 + stop)
+				return;
+
+			// Nothing is served after this, unlike a stop it is not asked for.
+			if (wait == WAIT_FAILED)
+			{
+				log_error("Pipe server stopped, could not wait for pipes (error {}).", GetLastError());
+				return;
+			}
+
+			const size_t index = wait - WAIT_OBJECT_0;
+			auto &pipe = _pipes[index];
+
+			try
+			{
+				if (!pipe.resume())
+					continue;
+
+				// Publishes the message read into the channel's buffer as well.
+				const size_t head = _received_head.load(std::memory_order_relaxed);
+				_received[head % _received.size()] = index;
+				_received_head.store(head + 1, std::memory_order_release);
+			}
+			catch (std::exception &e)
+			{
+				// Expected when clients go away, so not worth more than a debug message.
+				log_debug("Pipe server: {}", e.what());
+				pipe.restart();
+			}
 		}
 	}
 };
@@ -0,0 +1,439 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <emmintrin.h>
+#include <immintrin.h>
+#include <intrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string_view>
+
+export module pixels;
+
+// Copy using non-temporal stores. Frames are read by another thread much later,
+// caching them would only evict the game's data.
+static void stream_copy(std::byte *dst, const std::byte *src, size_t size)
+{
+	// Stores must be aligned, loads need not be.
+	size_t head = std::min(size, (16 - (uintptr_t(dst) & 15)) & 15);
+	std::memcpy(dst, src, head);
+	dst += head;
+	src += head;
+	size -= head;
+
+	for (; size >= 64; size -= 64, dst += 64, src += 64)
+	{
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 16));
+		__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 32));
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 48));
+		_mm_stream_si128(reinterpret_cast<__m128i *>(dst), a);
+		_mm_stream_si128(reinterpret_cast<__m128i *>(dst + 16), b);
+		_mm_stream_si128(reinterpret_cast<__m128i *>(dst + 32), c);
+		_mm_stream_si128(reinterpret_cast<__m128i *>(dst + 48), d);
+	}
+
+	for (; size >= 16; size -= 16, dst += 16, src += 16)
+	{
+		_mm_stream_si128(reinterpret_cast<__m128i *>(dst), _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+	}
+
+	std::memcpy(dst, src, size);
+}
+
+/// <summary>
+/// Copy <paramref name="rows"/> rows of <paramref name="row_size"/> bytes between images with different row pitches.
+/// Used to strip the padding drivers add to rows of mapped textures.
+/// </summary>
+export void copy_rows(void *dst, size_t dst_pitch, const void *src, size_t src_pitch, size_t row_size, size_t rows)
+{
+	auto d = static_cast<std::byte *>(dst);
+	auto s = static_cast<const std::byte *>(src);
+
+	if (dst_pitch == row_size && src_pitch == row_size)
+	{
+		// No padding on either side, copy in one go.
+		stream_copy(d, s, row_size * rows);
+	}
+	else
+	{
+		for (size_t y = 0; y < rows; y++)
+			stream_copy(d + y * dst_pitch, s + y * src_pitch, row_size);
+	}
+
+	// Make streamed stores visible to the thread that will read them.
+	_mm_sfence();
+}
+
+export enum class yuv_layout
+{
+	yuv420p,  // Y, U and V planes
+	nv12,     // Y plane and interleaved UV plane
+};
+
+export enum class color_matrix
+{
+	bt601,
+	bt709,
+};
+
+export std::optional<yuv_layout> parse_yuv_layout(std::string_view str)
+{
+	if (str == "yuv420p")
+		return yuv_layout::yuv420p;
+	if (str == "nv12")
+		return yuv_layout::nv12;
+	return std::nullopt;
+}
+
+export std::optional<color_matrix> parse_color_matrix(std::string_view str)
+{
+	if (str == "bt601")
+		return color_matrix::bt601;
+	if (str == "bt709")
+		return color_matrix::bt709;
+	return std::nullopt;
+}
+
+/// <summary>
+/// Fixed-point RGB to YUV coefficients with 15 fractional bits, in source channel order (alpha is always 0).
+/// </summary>
+export struct yuv_coefficients
+{
+	static constexpr int shift = 15;
+
+	int16_t y[4];
+	int16_t u[4];
+	int16_t v[4];
+	int y_offset;
+
+	yuv_coefficients(color_matrix matrix, bool full_range, bool bgr_order)
+	{
+		const double kr = matrix == color_matrix::bt709 ? 0.2126 : 0.299;
+		const double kb = matrix == color_matrix::bt709 ? 0.0722 : 0.114;
+		const double kg = 1.0 - kr - kb;
+
+		const double y_scale = full_range ? 1.0 : 219.0 / 255.0;
+		const double c_scale = full_range ? 1.0 : 224.0 / 255.0;
+		y_offset = full_range ? 0 : 16;
+
+		auto fixed = [](double c) { return int16_t(std::lround(c * (1 << shift))); };
+		auto store = [&](int16_t (&dst)[4], double r, double g, double b) {
+			dst[0] = fixed(bgr_order ? b : r);
+			dst[1] = fixed(g);
+			dst[2] = fixed(bgr_order ? r : b);
+			dst[3] = 0;
+		};
+
+		store(y, kr * y_scale, kg * y_scale, kb * y_scale);
+		store(u, -kr / (2 * (1 - kb)) * c_scale, -kg / (2 * (1 - kb)) * c_scale, 0.5 * c_scale);
+		store(v, 0.5 * c_scale, -kg / (2 * (1 - kr)) * c_scale, -kb / (2 * (1 - kr)) * c_scale);
+	}
+};
+
+static uint8_t clamp_u8(int value)
+{
+	return uint8_t(std::clamp(value, 0, 255));
+}
+
+static int dot(const int16_t (&c)[4], const uint8_t *p)
+{
+	return (c[0] * p[0] + c[1] * p[1] + c[2] * p[2] + (1 << (yuv_coefficients::shift - 1))) >> yuv_coefficients::shift;
+}
+
+// Converts a 2x2 block at column 'x', repeating the last column/row at odd edges.
+static void convert_block_scalar(const uint8_t *row0, const uint8_t *row1, bool has_row1, uint32_t x, uint32_t width,
+								 const yuv_coefficients &c, yuv_layout layout, uint8_t *y0, uint8_t *y1, uint8_t *uv, size_t u_offset)
+{
+	const uint32_t x1 = std::min(x + 1, width - 1);
+	const uint8_t *p[4] = { row0 + x * 4, row0 + x1 * 4, row1 + x * 4, row1 + x1 * 4 };
+
+	y0[x] = clamp_u8(dot(c.y, p[0]) + c.y_offset);
+	if (x1 != x)
+		y0[x1] = clamp_u8(dot(c.y, p[1]) + c.y_offset);
+
+	if (has_row1)
+	{
+		y1[x] = clamp_u8(dot(c.y, p[2]) + c.y_offset);
+		if (x1 != x)
+			y1[x1] = clamp_u8(dot(c.y, p[3]) + c.y_offset);
+	}
+
+	uint8_t avg[4];
+	for (int i = 0; i < 4; i++)
+		avg[i] = uint8_t((p[0][i] + p[1][i] + p[2][i] + p[3][i] + 2) >> 2);
+
+	uint8_t u = clamp_u8(dot(c.u, avg) + 128);
+	uint8_t v = clamp_u8(dot(c.v, avg) + 128);
+
+	if (layout == yuv_layout::nv12)
+	{
+		uv[x] = u;
+		uv[x + 1] = v;
+	}
+	else
+	{
+		uv[x / 2] = u;
+		uv[x / 2 + u_offset] = v;
+	}
+}
+
+// Converts 16 pixels of two rows, bit-exact with convert_block_scalar.
+static void convert_16_avx2(const uint8_t *row0, const uint8_t *row1, const yuv_coefficients &c,
+							uint8_t *y0, uint8_t *y1, __m128i &u, __m128i &v)
+{
+	auto broadcast = [](const int16_t (&coeffs)[4]) {
+		int64_t bits;
+		std::memcpy(&bits, coeffs, sizeof(bits));
+		return _mm256_set1_epi64x(bits);
+	};
+
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i y_coeffs = broadcast(c.y);
+	const __m256i u_coeffs = broadcast(c.u);
+	const __m256i v_coeffs = broadcast(c.v);
+	const __m256i round = _mm256_set1_epi32(1 << (yuv_coefficients::shift - 1));
+	const __m256i y_offset = _mm256_set1_epi32(c.y_offset);
+	const __m256i uv_offset = _mm256_set1_epi32(128);
+
+	// Pixels 0-1 and 4-5 in 'lo', 2-3 and 6-7 in 'hi' (AVX2 unpacks work per 128-bit lane).
+	auto luma = [&](__m256i lo, __m256i hi) {
+		__m256i sum = _mm256_hadd_epi32(_mm256_madd_epi16(lo, y_coeffs), _mm256_madd_epi16(hi, y_coeffs));
+		return _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(sum, round), yuv_coefficients::shift), y_offset);
+	};
+
+	// Packs 2x8 32-bit results (each ordered 0-3 | 4-7) into 16 bytes.
+	auto pack = [](__m256i a, __m256i b) {
+		__m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		__m256i bytes = _mm256_packus_epi16(words, words);
+		return _mm256_castsi256_si128(_mm256_permute4x64_epi64(bytes, _MM_SHUFFLE(3, 1, 2, 0)));
+	};
+
+	__m256i y_rows[2][2];
+	__m256i uv[2];
+
+	for (int k = 0; k < 2; k++)
+	{
+		__m256i p0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row0 + k * 32));
+		__m256i p1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row1 + k * 32));
+
+		__m256i lo0 = _mm256_unpacklo_epi8(p0, zero);
+		__m256i hi0 = _mm256_unpackhi_epi8(p0, zero);
+		__m256i lo1 = _mm256_unpacklo_epi8(p1, zero);
+		__m256i hi1 = _mm256_unpackhi_epi8(p1, zero);
+
+		y_rows[0][k] = luma(lo0, hi0);
+		y_rows[1][k] = luma(lo1, hi1);
+
+		// Sum vertically, then horizontally neighboring pixels, giving blocks 0 and 1 | 2 and 3.
+		__m256i lo = _mm256_add_epi16(lo0, lo1);
+		__m256i hi = _mm256_add_epi16(hi0, hi1);
+		lo = _mm256_add_epi16(lo, _mm256_srli_si256(lo, 8));
+		hi = _mm256_add_epi16(hi, _mm256_srli_si256(hi, 8));
+		__m256i avg = _mm256_srli_epi16(_mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_set1_epi16(2)), 2);
+
+		// U0 U1 V0 V1 | U2 U3 V2 V3
+		__m256i sum = _mm256_hadd_epi32(_mm256_madd_epi16(avg, u_coeffs), _mm256_madd_epi16(avg, v_coeffs));
+		uv[k] = _mm256_add_epi32(_mm256_srai_epi32(_mm256_add_epi32(sum, round), yuv_coefficients::shift), uv_offset);
+	}
+
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(y0), pack(y_rows[0][0], y_rows[0][1]));
+	_mm_storeu_si128(reinterpret_cast<__m128i *>(y1), pack(y_rows[1][0], y_rows[1][1]));
+
+	// Packed words are U0 U1 V0 V1 U4 U5 V4 V5 | U2 U3 V2 V3 U6 U7 V6 V7, after the permute
+	// U0 U1 V0 V1 U2 U3 V2 V3 | U4 U5 V4 V5 U6 U7 V6 V7. Regroup to U0-U7 | V0-V7.
+	__m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(uv[0], uv[1]), _MM_SHUFFLE(3, 1, 2, 0));
+	const __m256i group = _mm256_setr_epi8(
+		0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7, 12, 13, 14, 15,
+		0, 1, 2, 3, 8, 9, 10, 11, 4, 5, 6, 7, 12, 13, 14, 15);
+	words = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(words, group), _MM_SHUFFLE(3, 1, 2, 0));
+	__m256i bytes = _mm256_packus_epi16(words, words);
+
+	u = _mm256_castsi256_si128(bytes);
+	v = _mm256_extracti128_si256(bytes, 1);
+}
+
+static void convert_rows(const uint8_t *row0, const uint8_t *row1, bool has_row1, uint32_t width, const yuv_coefficients &c,
+						 yuv_layout layout, uint8_t *y0, uint8_t *y1, uint8_t *uv, size_t u_offset, bool avx2)
+{
+	uint32_t x = 0;
+
+	if (avx2 && has_row1)
+	{
+		uint8_t *const u = uv;
+		uint8_t *const v = uv + u_offset;
+
+		for (; x + 16 <= width; x += 16)
+		{
+			__m128i u8, v8;
+			convert_16_avx2(row0 + x * 4, row1 + x * 4, c, y0 + x, y1 + x, u8, v8);
+
+			if (layout == yuv_layout::nv12)
+			{
+				_mm_storeu_si128(reinterpret_cast<__m128i *>(uv + x), _mm_unpacklo_epi8(u8, v8));
+			}
+			else
+			{
+				_mm_storel_epi64(reinterpret_cast<__m128i *>(u + x / 2), u8);
+				_mm_storel_epi64(reinterpret_cast<__m128i *>(v + x / 2), v8);
+			}
+		}
+	}
+
+	for (; x < width; x += 2)
+		convert_block_scalar(row0, row1, has_row1, x, width, c, layout, y0, y1, uv, u_offset);
+}
+
+/// <summary>
+/// Size of a tightly packed 4:2:0 image. Chroma planes are rounded up for odd dimensions, like FFmpeg does.
+/// </summary>
+export size_t yuv420_size(uint32_t width, uint32_t height)
+{
+	return size_t(width) * height + 2 * size_t((width + 1) / 2) * ((height + 1) / 2);
+}
+
+/// <summary>
+/// Convert 8-bit RGBA/BGRA (channel order given by coefficients) to tightly packed 4:2:0 YUV.
+/// Chroma is the rounded average of each 2x2 block. The AVX2 path, used when supported, gives identical results.
+/// </summary>
+export void convert_to_yuv420(const void *src, size_t src_pitch, uint32_t width, uint32_t height,
+							  const yuv_coefficients &c, yuv_layout layout, void *dst, bool allow_avx2 = true)
+{
+	static const bool avx2_supported = [] {
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+
+		// OS must save AVX registers.
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+			return false;
+
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	}();
+
+	const bool avx2 = allow_avx2 && avx2_supported;
+
+	const size_t chroma_width = (width + 1) / 2;
+	const size_t chroma_height = (height + 1) / 2;
+
+	auto s = static_cast<const uint8_t *>(src);
+	auto y_plane = static_cast<uint8_t *>(dst);
+	auto uv_plane = y_plane + size_t(width) * height;
+
+	// NV12 rows hold U and V pairs, planar rows hold U with V one plane further.
+	const size_t uv_pitch = layout == yuv_layout::nv12 ? chroma_width * 2 : chroma_width;
+	const size_t u_offset = layout == yuv_layout::nv12 ? 1 : chroma_width * chroma_height;
+
+	for (uint32_t y = 0; y < height; y += 2)
+	{
+		const bool has_row1 = y + 1 < height;
+		const uint8_t *row0 = s + y * src_pitch;
+		const uint8_t *row1 = has_row1 ? row0 + src_pitch : row0;
+
+		convert_rows(row0, row1, has_row1, width, c, layout,
+					 y_plane + size_t(y) * width, y_plane + size_t(y + 1) * width,
+					 uv_plane + (y / 2) * uv_pitch, u_offset, avx2);
+	}
+}
+
+/// <summary>
+/// Convert floats to 16-bit unsigned integers, mapping [0, 1] to the full range. Out of range values and NaN are clamped.
+/// </summary>
+export void convert_float_to_u16(const float *src, uint16_t *dst, size_t count)
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 scale = _mm_set1_ps(65535.0f);
+	const __m128i bias = _mm_set1_epi32(32768);
+	const __m128i unbias = _mm_set1_epi16(int16_t(0x8000));
+
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		// Max returns the second operand for NaN.
+		__m128 a = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), zero), one), scale);
+		__m128 b = _mm_mul_ps(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4), zero), one), scale);
+
+		// SSE2 has no unsigned saturating pack, shift into signed range and back.
+		__m128i ia = _mm_sub_epi32(_mm_cvtps_epi32(a), bias);
+		__m128i ib = _mm_sub_epi32(_mm_cvtps_epi32(b), bias);
+		__m128i packed = _mm_xor_si128(_mm_packs_epi32(ia, ib), unbias);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), packed);
+	}
+
+	for (; i < count; i++)
+	{
+		float value = src[i] > 0.0f ? std::min(src[i], 1.0f) : 0.0f;
+		dst[i] = uint16_t(std::nearbyint(value * 65535.0f));
+	}
+}
+
+/// <summary>
+/// Converts frames of a recording on the writer thread, each result stays valid until the next call.
+/// </summary>
+export class frame_converter
+{
+public:
+	virtual ~frame_converter() = default;
+
+	virtual std::span<const std::byte> convert(std::span<const std::byte> frame) = 0;
+};
+
+/// <summary>
+/// Converts tightly packed RGBA/BGRA frames to 4:2:0 YUV.
+/// </summary>
+export class yuv_converter : public frame_converter
+{
+private:
+	uint32_t _width;
+	uint32_t _height;
+	yuv_coefficients _coeffs;
+	yuv_layout _layout;
+	std::unique_ptr<std::byte[]> _buffer;
+
+public:
+	yuv_converter(uint32_t width, uint32_t height, const yuv_coefficients &coeffs, yuv_layout layout)
+		: _width{ width }, _height{ height }, _coeffs{ coeffs }, _layout{ layout },
+		_buffer{ std::make_unique_for_overwrite<std::byte[]>(yuv420_size(width, height)) }
+	{}
+
+	std::span<const std::byte> convert(std::span<const std::byte> frame) override
+	{
+		convert_to_yuv420(frame.data(), size_t(_width) * 4, _width, _height, _coeffs, _layout, _buffer.get());
+		return { _buffer.get(), yuv420_size(_width, _height) };
+	}
+};
+
+/// <summary>
+/// Converts single channel float frames, like depth, to 16-bit gray which most lossless encoders accept.
+/// </summary>
+export class gray16_converter : public frame_converter
+{
+private:
+	size_t _count;
+	std::unique_ptr<uint16_t[]> _buffer;
+
+public:
+	gray16_converter(uint32_t width, uint32_t height)
+		: _count{ size_t(width) * height }, _buffer{ std::make_unique_for_overwrite<uint16_t[]>(_count) }
+	{}
+
+	std::span<const std::byte> convert(std::span<const std::byte> frame) override
+	{
+		convert_float_to_u16(reinterpret_cast<const float *>(frame.data()), _buffer.get(), _count);
+		return std::as_bytes(std::span(_buffer.get(), _count));
+	}
+};
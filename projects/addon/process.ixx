@@ -5,8 +5,12 @@ module;
 #include <Windows.h>
 #include <wil/resource.h>
 
+#include <algorithm>
+#include <cstddef>
 #include <format>
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
 export module process;
 
@@ -21,10 +25,18 @@ export struct process_error : std::runtime_error
 export class process
 {
 public:
-	void redirect_input();
+	// A buffer size of 0 uses the system default, which is only a few KB.
+	void redirect_input(size_t buffer_size = 0);
 
 	void redirect_output(const char *file);
 
+	// Connect standard output to the input of 'consumer', after it was started with 'redirect_input'.
+	// Standard error does not go into the pipe, so nothing but output ends up there. See 'redirect_errors'.
+	void redirect_output(process &consumer);
+
+	// Write standard error to where 'source' writes its output, before 'source' is started.
+	void redirect_errors(process &source);
+
 	void start(const char *path, char *args);
 
 	void send_input(const void *data, size_t length);
@@ -33,6 +45,8 @@ public:
 
 	void close() noexcept;
 
+	HANDLE handle() const { return _process_info.hProcess; }
+
 	process() = default;
 
 	// No copying.
@@ -50,7 +64,8 @@ private:
 
 	pipe _stdin;
 	pipe _stdout;
-	// pipe _stderr;
+	wil::unique_handle _stderr;  // if not together with output
+	bool _redirect_errors = true;
 
 	wil::unique_process_information _process_info;
 };
@@ -61,12 +76,12 @@ SECURITY_ATTRIBUTES security_attributes = {
 	.bInheritHandle = TRUE,
 };
 
-void process::redirect_input()
+void process::redirect_input(size_t buffer_size)
 {
 	try
 	{
 		HANDLE read, write;
-		win::CreatePipe(&read, &write, &security_attributes, 0);
+		win::CreatePipe(&read, &write, &security_attributes, DWORD(std::min<size_t>(buffer_size, MAXDWORD)));
 
 		_stdin.read.reset(read);
 		_stdin.write.reset(write);
@@ -94,21 +109,94 @@ void process::redirect_output(const char *file)
 	}
 }
 
+void process::redirect_output(process &consumer)
+{
+	try
+	{
+		// Was kept from being inherited by the consumer, which would then never see the end of its input.
+		_stdout.write = std::move(consumer._stdin.write);
+		win::SetHandleInformation(_stdout.write.get(), HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+		_redirect_errors = false;
+	}
+	catch (std::exception &)
+	{
+		std::throw_with_nested(process_error("Could not set up output redirection to process."));
+	}
+}
+
+void process::redirect_errors(process &source)
+{
+	try
+	{
+		// Shares the file pointer, so both processes append.
+		HANDLE h;
+		win::DuplicateHandle(GetCurrentProcess(), source._stdout.write.get(), GetCurrentProcess(), &h, 0, TRUE, DUPLICATE_SAME_ACCESS);
+
+		_stderr.reset(h);
+		_redirect_errors = false;
+	}
+	catch (std::exception &)
+	{
+		std::throw_with_nested(process_error("Could not set up error redirection."));
+	}
+}
+
 void process::start(const char *path, char *args)
 {
-	STARTUPINFOA startup_info = {
-		.cb = sizeof(STARTUPINFO),
-		.dwFlags = STARTF_USESTDHANDLES,
-		.hStdInput = _stdin.read.get(),
-		.hStdOutput = _stdout.write.get(),
-		.hStdError = _stdout.write.get(),
+	STARTUPINFOEXA startup_info = {
+		.StartupInfo = {
+			.cb = sizeof(STARTUPINFOEXA),
+			.dwFlags = STARTF_USESTDHANDLES,
+			.hStdInput = _stdin.read.get(),
+			.hStdOutput = _stdout.write.get(),
+			.hStdError = _redirect_errors ? _stdout.write.get() : _stderr.get(),
+		},
 	};
 
+	// Encoders of several streams start at once from their writer threads. Only the handles meant for this process
+	// are inherited, otherwise it could keep another encoder's input pipe open, which then never ends, or its log.
+	std::vector<HANDLE> inherited;
+	for (HANDLE h : { startup_info.StartupInfo.hStdInput, startup_info.StartupInfo.hStdOutput, startup_info.StartupInfo.hStdError })
+	{
+		if (h != NULL && std::find(inherited.begin(), inherited.end(), h) == inherited.end())
+			inherited.push_back(h);
+	}
+
 	try
 	{
-		win::CreateProcessA(path, args, NULL, NULL, TRUE, CREATE_NO_WINDOW, NULL, NULL, &startup_info, &_process_info);
+		std::unique_ptr<std::byte[]> attributes;
+
+		if (!inherited.empty())
+		{
+			SIZE_T size = 0;
+			InitializeProcThreadAttributeList(NULL, 1, 0, &size);  // fails, with the size needed
+
+			attributes = std::make_unique<std::byte[]>(size);
+			startup_info.lpAttributeList = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributes.get());
+
+			win::InitializeProcThreadAttributeList(startup_info.lpAttributeList, 1, 0, &size);
+
+			auto update = win::res::UpdateProcThreadAttribute(startup_info.lpAttributeList, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+															  inherited.data(), inherited.size() * sizeof(HANDLE), NULL, NULL);
+			if (!update.ok())
+			{
+				DeleteProcThreadAttributeList(startup_info.lpAttributeList);
+				throw update.make_error();
+			}
+		}
+
+		auto res = win::res::CreateProcessA(path, args, NULL, NULL, !inherited.empty(), CREATE_NO_WINDOW | EXTENDED_STARTUPINFO_PRESENT,
+											NULL, NULL, &startup_info.StartupInfo, &_process_info);
+
+		if (startup_info.lpAttributeList != NULL)
+			DeleteProcThreadAttributeList(startup_info.lpAttributeList);
+
+		if (!res.ok())
+			throw res.make_error();
+
 		_stdin.read.reset();
 		_stdout.write.reset();
+		_stderr.reset();
 	}
 	catch (std::exception)
 	{
@@ -117,23 +205,32 @@ void process::start(const char *path, char *args)
 	}
 }
 
-// Blocking.
+// Blocking, until all bytes are written.
 void process::send_input(const void *data, size_t length)
 {
-	DWORD written = 0;
+	auto bytes = static_cast<const std::byte *>(data);
 
 	try
 	{
-		win::WriteFile(_stdin.write.get(), data, DWORD(length), &written, NULL);
+		while (length != 0)
+		{
+			DWORD written = 0;
+			win::WriteFile(_stdin.write.get(), bytes, DWORD(std::min<size_t>(length, MAXDWORD)), &written, NULL);
+
+			// Pipes may take less than asked, but not nothing.
+			if (written == 0)
+			{
+				throw process_error("No bytes were written.");
+			}
+
+			bytes += written;
+			length -= written;
+		}
 	}
 	catch (std::exception &)
 	{
 		std::throw_with_nested(process_error("Could not write to standard input."));
 	}
-
-	if (written != length) {
-		log_warning("WriteFile : not all bytes were written");
-	}
 }
 
 int process::wait_for_exit() {
@@ -162,4 +259,5 @@ void process::close() noexcept
 	_stdin.read.reset();
 	_stdout.read.reset();
 	_stdout.write.reset();
+	_stderr.reset();
 }
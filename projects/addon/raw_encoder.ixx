@@ -0,0 +1,69 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <cstddef>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+
+export module raw_encoder;
+
+import rawvideo;
+import recording;
+
+using std::string_view;
+
+/// <summary>
+/// Store frames as they are into a raw video file, compressed with LZ4 on <paramref name="threads"/> threads
+/// if this build supports it, for games too fast to encode while playing. 'rawconvert' encodes them afterwards.
+/// Written around the system cache with <paramref name="write_depth"/> writes in flight, 0 to go through it.
+/// </summary>
+export std::unique_ptr<encoder> make_raw_encoder(string_view filename, const video_format &format, unsigned threads, unsigned write_depth);
+
+class raw_encoder : public encoder
+{
+private:
+	std::string _filename;
+	rawvideo_writer _writer;
+
+public:
+	raw_encoder(string_view filename, const video_format &format, unsigned threads, unsigned write_depth);
+
+	void write(std::span<const std::byte> frame, bool) override { _writer.write(frame); }
+
+	void finish() override;
+
+	void rename(string_view filename) override;
+};
+
+raw_encoder::raw_encoder(string_view filename, const video_format &format, unsigned threads, unsigned write_depth)
+	: _filename{ filename },
+	  _writer{ _filename, { format.width, format.height, std::string(format.pixel_format), format.framerate,
+							std::string(format.color_space), std::string(format.color_range) }, threads, write_depth }
+{
+}
+
+void raw_encoder::finish()
+{
+	_writer.finish();
+
+	if (_writer.raw_size() != 0)
+	{
+		log_info("Wrote {} frames to '{}', {:.1f} MiB stored for {:.1f} MiB of frames ({:.2f}:1).", _writer.frame_count(), _filename,
+				 _writer.stored_size() / 1048576.0, _writer.raw_size() / 1048576.0, double(_writer.raw_size()) / _writer.stored_size());
+	}
+}
+
+void raw_encoder::rename(string_view filename)
+{
+	std::string destination(filename);
+	move_file(_filename, destination);
+	_filename = destination;
+}
+
+std::unique_ptr<encoder> make_raw_encoder(string_view filename, const video_format &format, unsigned threads, unsigned write_depth)
+{
+	return std::make_unique<raw_encoder>(filename, format, threads, write_depth);
+}
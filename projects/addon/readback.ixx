@@ -0,0 +1,368 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+export module readback;
+
+import stats;
+import utils;
+
+export struct readback_error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+/// <summary>
+/// Tracks copies submitted to the GPU with one fence, shared by all streams so a frame's copies are submitted together.
+/// </summary>
+export class copy_timeline
+{
+private:
+	reshade::api::device *_device = nullptr;
+	reshade::api::command_queue *_queue = nullptr;  // to wait before textures are destroyed
+
+	// Copies are tracked with a fence where supported, otherwise with 'wait_idle'.
+	reshade::api::fence _fence = {};
+	uint64_t _signaled_value = 0;
+	uint64_t _completed_value = 0;
+
+public:
+	copy_timeline() = default;
+
+	~copy_timeline() { destroy(); }
+
+	// No copying or moving, rings keep a pointer.
+	copy_timeline(const copy_timeline &) = delete;
+	copy_timeline &operator=(const copy_timeline &) = delete;
+
+	void create(reshade::api::device *device, reshade::api::command_queue *queue);
+
+	void destroy() noexcept;
+
+	reshade::api::device *device() const { return _device; }
+
+	/// <summary>
+	/// Value the next <see cref="submit"/> signals, copies recorded until then are done once it is reached.
+	/// </summary>
+	uint64_t next_value() const { return _signaled_value + 1; }
+
+	/// <summary>
+	/// Submit copies recorded into the immediate command list.
+	/// </summary>
+	void submit(reshade::api::command_queue *queue);
+
+	/// <summary>
+	/// Whether copies of <paramref name="value"/> are done, waiting for them if <paramref name="block"/> is set.
+	/// </summary>
+	bool wait_for(reshade::api::command_queue *queue, uint64_t value, bool block);
+
+	/// <summary>
+	/// Wait for copies of <paramref name="value"/>, or for the queue to be idle if that fails, so their textures can be destroyed.
+	/// </summary>
+	void finish(uint64_t value) noexcept;
+};
+
+/// <summary>
+/// Travels with a copy through the readback ring.
+/// </summary>
+export struct copy_info
+{
+	uint64_t frame_index = 0;  // see frame_stamp
+	uint32_t repeat = 1;       // see frame_pacer
+};
+
+/// <summary>
+/// Ring of host-visible staging textures. Frame K is copied into one slot while
+/// earlier slots are still in flight, so the CPU only waits for the GPU when the ring is full.
+/// </summary>
+export class readback_ring
+{
+private:
+	struct slot
+	{
+		reshade::api::resource resource = {};
+		uint64_t fence_value = 0;
+		copy_info info;
+	};
+
+	copy_timeline *_timeline = nullptr;
+	reshade::api::resource_desc _desc = {};
+	std::vector<slot> _slots;
+
+	size_t _head = 0;  // next slot to copy into
+	size_t _tail = 0;  // oldest slot with a pending copy
+	size_t _pending = 0;
+
+	pipeline_stats *_stats = nullptr;
+
+public:
+	readback_ring() = default;
+
+	~readback_ring() { destroy(); }
+
+	// No copying.
+	readback_ring(const readback_ring &) = delete;
+	readback_ring &operator=(const readback_ring &) = delete;
+
+	readback_ring(readback_ring &&other) noexcept { *this = std::move(other); }
+
+	readback_ring &operator=(readback_ring &&other) noexcept
+	{
+		if (this != &other)
+		{
+			destroy();
+			_timeline = std::exchange(other._timeline, nullptr);
+			_desc = other._desc;
+			_slots = std::move(other._slots);
+			_head = other._head;
+			_tail = other._tail;
+			_pending = std::exchange(other._pending, 0);
+			_stats = other._stats;
+		}
+		return *this;
+	}
+
+	void create(copy_timeline &timeline, const reshade::api::resource_desc &desc, int depth);
+
+	void destroy() noexcept;
+
+	const reshade::api::resource_desc &desc() const { return _desc; }
+
+	bool is_full() const { return _pending == _slots.size(); }
+
+	/// <summary>
+	/// Time waits for copies and mapping into <paramref name="stats"/>, which must outlive the ring.
+	/// </summary>
+	void set_stats(pipeline_stats *stats) { _stats = stats; }
+
+	size_t pending() const { return _pending; }
+
+	/// <summary>
+	/// Info of the <paramref name="index"/>-th pending copy, oldest first.
+	/// </summary>
+	const copy_info &pending_info(size_t index) const { return _slots[(_tail + index) % _slots.size()].info; }
+
+	/// <summary>
+	/// Number of pending copies that are done, in submission order, without waiting.
+	/// </summary>
+	size_t completed(reshade::api::command_queue *queue)
+	{
+		size_t count = 0;
+		while (count < _pending && _timeline->wait_for(queue, _slots[(_tail + count) % _slots.size()].fence_value, false))
+			count++;
+		return count;
+	}
+
+	/// <summary>
+	/// Record a copy of <paramref name="source"/> into the next slot, done with the timeline's next submit.
+	/// The source must be in copy_source state and the ring must not be full.
+	/// <paramref name="info"/> is passed back with the data.
+	/// </summary>
+	void copy(reshade::api::command_list *cmd_list, reshade::api::resource source, const copy_info &info = {});
+
+	/// <summary>
+	/// Map finished copies in submission order and pass them to <paramref name="callback"/> with their copy_info.
+	/// Waits for at least <paramref name="min_count"/> copies, then takes any others that are already done,
+	/// up to <paramref name="max_count"/>.
+	/// </summary>
+	template<typename F>
+	size_t read(reshade::api::command_queue *queue, size_t min_count, size_t max_count, F callback)
+	{
+		size_t count = 0;
+
+		while (_pending != 0 && count < max_count)
+		{
+			{
+				// Polls for copies that are already done are not timed.
+				const bool wait = count < min_count;
+				stage_timer timer(wait ? _stats : nullptr, stage::wait);
+
+				if (!_timeline->wait_for(queue, _slots[_tail].fence_value, wait))
+					break;
+			}
+
+			slot &s = _slots[_tail];
+
+			// Release the slot before handing out data, so a throwing callback leaves the ring consistent.
+			s.fence_value = 0;
+			_tail = (_tail + 1) % _slots.size();
+			_pending--;
+			count++;
+
+			reshade::api::subresource_data host_data;
+			reshade::api::device *const device = _timeline->device();
+
+			{
+				stage_timer timer(_stats, stage::map);
+
+				if (!device->map_texture_region(s.resource, 0, nullptr, reshade::api::map_access::read_only, &host_data))
+				{
+					throw readback_error("Could not access stream texture data.");
+				}
+			}
+
+			context_manager unmap_texture_region([&] { device->unmap_texture_region(s.resource, 0); });
+
+			callback(host_data, s.info);
+		}
+
+		return count;
+	}
+
+	template<typename F>
+	size_t read(reshade::api::command_queue *queue, size_t min_count, F callback)
+	{
+		return read(queue, min_count, SIZE_MAX, callback);
+	}
+};
+
+void copy_timeline::create(reshade::api::device *device, reshade::api::command_queue *queue)
+{
+	destroy();
+
+	_device = device;
+	_queue = queue;
+
+	// Not every API supports fences (e.g. D3D9, older D3D11 drivers), fall back to waiting for idle.
+	if (!device->create_fence(0, reshade::api::fence_flags::none, &_fence))
+	{
+		_fence = {};
+		log_debug("Fences not supported, falling back to wait_idle for readback.");
+	}
+}
+
+void copy_timeline::destroy() noexcept
+{
+	if (_device != nullptr && _fence != 0)
+		_device->destroy_fence(_fence);
+
+	_device = nullptr;
+	_queue = nullptr;
+	_fence = {};
+	_signaled_value = 0;
+	_completed_value = 0;
+}
+
+void copy_timeline::submit(reshade::api::command_queue *queue)
+{
+	queue->flush_immediate_command_list();
+
+	// Copies whose signal failed are covered by the next one.
+	if (_fence != 0 && !queue->signal(_fence, next_value()))
+	{
+		throw readback_error("Could not signal copy fence.");
+	}
+
+	_signaled_value++;
+}
+
+bool copy_timeline::wait_for(reshade::api::command_queue *queue, uint64_t value, bool block)
+{
+	if (_fence != 0)
+	{
+		if (_device->get_completed_fence_value(_fence) >= value)
+			return true;
+
+		if (!block)
+			return false;
+
+		if (!_device->wait(_fence, value, std::numeric_limits<uint64_t>::max()))
+		{
+			throw readback_error("Could not wait for copy to finish.");
+		}
+
+		return true;
+	}
+
+	if (_completed_value >= value)
+		return true;
+
+	if (!block)
+		return false;
+
+	queue->wait_idle();
+	_completed_value = _signaled_value;
+
+	return true;
+}
+
+void copy_timeline::finish(uint64_t value) noexcept
+{
+	if (_queue == nullptr)
+		return;
+
+	// Copies that were never signaled would be waited for forever, 'wait_idle' flushes them.
+	if (value <= _signaled_value)
+	{
+		try
+		{
+			wait_for(_queue, value, true);
+			return;
+		}
+		catch (std::exception &ex)
+		{
+			log_warning("Could not wait for copies before releasing their textures: {}", ex.what());
+		}
+	}
+
+	_queue->wait_idle();
+	_completed_value = _signaled_value;
+}
+
+void readback_ring::create(copy_timeline &timeline, const reshade::api::resource_desc &desc, int depth)
+{
+	destroy();
+
+	_timeline = &timeline;
+	_desc = desc;
+	_slots.resize(std::max(depth, 1));
+
+	for (auto &s : _slots)
+	{
+		if (!timeline.device()->create_resource(desc, nullptr, reshade::api::resource_usage::copy_dest, &s.resource))
+		{
+			destroy();
+			throw readback_error("Failed to create host resource.");
+		}
+	}
+}
+
+void readback_ring::destroy() noexcept
+{
+	if (_timeline != nullptr)
+	{
+		// The GPU may still be copying into the slots, copies finish in order.
+		if (_pending != 0)
+			_timeline->finish(_slots[(_head + _slots.size() - 1) % _slots.size()].fence_value);
+
+		for (auto &s : _slots)
+		{
+			if (s.resource != 0)
+				_timeline->device()->destroy_resource(s.resource);
+		}
+	}
+
+	_slots.clear();
+	_head = _tail = _pending = 0;
+}
+
+void readback_ring::copy(reshade::api::command_list *cmd_list, reshade::api::resource source, const copy_info &info)
+{
+	assert(!is_full());
+
+	slot &s = _slots[_head];
+
+	cmd_list->copy_texture_region(source, 0, nullptr, s.resource, 0, nullptr);
+	s.fence_value = _timeline->next_value();
+	s.info = info;
+
+	_head = (_head + 1) % _slots.size();
+	_pending++;
+}
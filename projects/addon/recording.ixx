@@ -2,13 +2,30 @@ module;
 
 #include "stdafx.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <format>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 export module recording;
 
+import frame_queue;
+import monitor;
+import pixels;
 import process;
+import shared_ring;
+import stats;
+import winutils;
 
 using std::string_view;
 
@@ -17,75 +34,697 @@ export struct recording_error : std::runtime_error
 	using std::runtime_error::runtime_error;
 };
 
-export class recording
+/// <summary>
+/// Frames as they leave the queue, packed without row padding. Names are those used by FFmpeg.
+/// </summary>
+export struct video_format
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	string_view pixel_format;
+	int framerate = 0;
+	string_view color_space;  // empty if not known
+	string_view color_range;  // "tv" or "pc", empty if not known
+};
+
+/// <summary>
+/// Where the writer thread sends frames. Only used by one thread at a time.
+/// </summary>
+export class encoder
+{
+public:
+	virtual ~encoder() = default;
+
+	/// <summary>
+	/// Encode a frame, may block. <paramref name="more"/> tells whether another frame is queued right away.
+	/// </summary>
+	virtual void write(std::span<const std::byte> frame, bool more) = 0;
+
+	/// <summary>
+	/// Encode a frame that stands for <paramref name="repeat"/> video frames, by default by writing it that often.
+	/// </summary>
+	virtual void write_repeated(std::span<const std::byte> frame, uint32_t repeat, bool more)
+	{
+		for (uint32_t i = 0; i < repeat; i++)
+			write(frame, i + 1 < repeat || more);
+	}
+
+	/// <summary>
+	/// No more frames. Flushes and closes the output, throws if it is not valid.
+	/// </summary>
+	virtual void finish() = 0;
+
+	/// <summary>
+	/// After finish(), move the output and any files written next to it to <paramref name="filename"/>.
+	/// </summary>
+	virtual void rename(string_view filename) = 0;
+
+	/// <summary>
+	/// Encoding speed relative to real time, if the encoder reports it. Called between frames.
+	/// </summary>
+	virtual std::optional<double> speed() { return std::nullopt; }
+};
+
+export void move_file(const std::string &from, const std::string &to)
+{
+	try
+	{
+		win::MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_COPY_ALLOWED);
+	}
+	catch (std::exception &)
+	{
+		auto message = std::format("Could not rename '{}' to '{}'.", from, to);
+		std::throw_with_nested(recording_error(message));
+	}
+}
+
+export struct transport_options
+{
+	string_view relay;  // relay executable to pass frames through shared memory, empty to write to FFmpeg directly
+	size_t pipe_buffer_size = 0;  // 0 for the system default
+};
+
+/// <summary>
+/// Runs the FFmpeg executable and writes frames to its standard input.
+/// </summary>
+export class ffmpeg_encoder : public encoder
 {
 private:
-	bool _is_running = false;
 	process _ffmpeg;
+	process _relay;  // copies frames from the shared ring to FFmpeg, if used
+	std::unique_ptr<shared_ring_writer> _ring;
+	std::vector<std::byte> _batch;
+	std::string _filename;
 	std::string _logfile;
 
+	// Enough to keep the relay busy while the next frame is copied in, the frame queue does the buffering.
+	static constexpr size_t shared_slots = 3;
+
+	// Frames up to this size are gathered while more are queued, and written to the pipe together.
+	static constexpr size_t batch_frame_size = 256 * 1024;
+	static constexpr size_t batch_size = 1024 * 1024;
+
+	// Pipe buffers are kernel memory.
+	static constexpr size_t max_pipe_buffer_size = 256 * 1024 * 1024;
+
+public:
+	ffmpeg_encoder(string_view executable, string_view filename, const video_format &format, string_view output_options,
+				   size_t frame_size, const transport_options &transport);
+
+	void write(std::span<const std::byte> frame, bool more) override;
+
+	void finish() override;
+
+	void rename(string_view filename) override;
+
+	std::optional<double> speed() override;
+
+private:
+	void flush_batch();
+};
+
+export struct recording_counters
+{
+	uint64_t queued = 0;
+	uint64_t dropped = 0;
+	double start_latency_ms = -1.0;  // from start() until the encoder took the first frame, negative if it did not
+};
+
+/// <summary>
+/// Progress of a recording, as seen from the render thread.
+/// </summary>
+export enum class recording_state
+{
+	idle,
+	starting,    // encoder is starting, frames are queued meanwhile
+	running,
+	finalizing,  // stopped, the encoder is writing out what is left
+	failed,      // writer stopped with an error, not reported yet
+};
+
+export const char *to_string(recording_state state)
+{
+	switch (state)
+	{
+	case recording_state::starting:
+		return "starting";
+	case recording_state::running:
+		return "running";
+	case recording_state::finalizing:
+		return "finalizing";
+	case recording_state::failed:
+		return "failed";
+	default:
+		return "idle";
+	}
+}
+
+/// <summary>
+/// Creates an encoder writing to the given file, on another thread, so it must own everything it refers to.
+/// </summary>
+export using encoder_factory = std::function<std::unique_ptr<encoder>(string_view filename)>;
+
+/// <summary>
+/// An encoder started ahead of time, writing to a temporary file until its recording finishes.
+/// </summary>
+export struct warm_encoder
+{
+	std::string filename;
+	std::future<std::unique_ptr<encoder>> output;
+};
+
+/// <summary>
+/// Keeps an encoder started for the settings a stream would record with next, so starting a recording
+/// does not wait for FFmpeg to launch. Settings are compared by a key that covers everything the encoder depends on.
+/// </summary>
+export class encoder_pool
+{
+private:
+	std::string _key;
+	std::unique_ptr<warm_encoder> _warm;
+	std::vector<std::future<void>> _discarding;
+
 public:
-	void start(string_view executable, string_view filename, string_view input_options, string_view output_options);
+	encoder_pool() = default;
+	encoder_pool(encoder_pool &&) = default;
+	encoder_pool &operator=(encoder_pool &&) = default;
+	~encoder_pool() { clear(); }
+
+	bool has(string_view key) const { return _warm && _key == key; }
+
+	/// <summary>
+	/// Start an encoder for <paramref name="key"/> in the background, replacing one started for other settings.
+	/// <paramref name="filename"/> is where the recording will end up.
+	/// </summary>
+	void warm(std::string key, string_view filename, encoder_factory make_encoder);
+
+	/// <summary>
+	/// Hand out the encoder started for <paramref name="key"/>, if any. It may still be starting.
+	/// </summary>
+	std::optional<warm_encoder> take(string_view key);
+
+	/// <summary>
+	/// Stop the encoder in the background and delete what it wrote.
+	/// </summary>
+	void clear();
+
+	// Forget encoders done stopping.
+	void poll();
+};
+
+export class recording
+{
+private:
+	// Frames are written to the encoder from a dedicated thread, so a slow encoder does not block the game.
+	// The thread also starts and finishes the encoder, which can take seconds for FFmpeg.
+	// Kept on the heap so the thread's references stay valid when the recording is moved.
+	struct writer
+	{
+		std::string filename;
+		std::string output_filename;  // where the encoder writes, renamed to 'filename' when different
+		encoder_factory make_encoder;
+		std::unique_ptr<encoder> output;
+		frame_queue queue;
+		std::unique_ptr<frame_converter> converter;
+		std::thread thread;
+		std::atomic<recording_state> state = recording_state::starting;
+		std::exception_ptr error;  // set by the thread before it closes the queue
+		std::exception_ptr finish_error;  // set by the thread before it sets 'done'
+		std::atomic<bool> done = false;
+		bool error_reported = false;  // rethrown from push_frame already
+		recording_counters counters;
+		std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+		std::atomic<double> start_latency_ms = -1.0;
+		std::atomic<double> speed = -1.0;  // reported by the encoder, negative if it does not
+		std::shared_ptr<pipeline_stats> stats;
+
+		writer(size_t queue_size, size_t frame_size, queue_policy policy) : queue{ queue_size, frame_size, policy } {}
+
+		~writer()
+		{
+			queue.close();
+			if (thread.joinable())
+				thread.join();
+		}
+	};
+
+	bool _is_running = false;
+	std::unique_ptr<writer> _writer;
+	std::vector<std::unique_ptr<writer>> _finalizing;  // stopped, thread still finishing the encoder
+	recording_counters _counters;
+	std::shared_ptr<pipeline_stats> _stats;
+
+public:
+	/// <summary>
+	/// Time queueing, conversion and encoding of this and later recordings into <paramref name="stats"/>.
+	/// </summary>
+	void set_stats(std::shared_ptr<pipeline_stats> stats) { _stats = std::move(stats); }
+
+	/// <summary>
+	/// Returns right away, <paramref name="make_encoder"/> runs on the writer thread.
+	/// Frames pushed before the encoder is ready wait in the queue.
+	/// </summary>
+	void start(string_view filename, encoder_factory make_encoder, size_t frame_size, size_t queue_size, queue_policy policy,
+			   std::unique_ptr<frame_converter> converter = nullptr);
+
+	/// <summary>
+	/// Same, with an encoder from an encoder_pool. Its output is renamed to <paramref name="filename"/> when finished.
+	/// </summary>
+	void start(string_view filename, warm_encoder warm, size_t frame_size, size_t queue_size, queue_policy policy,
+			   std::unique_ptr<frame_converter> converter = nullptr);
 
 	bool is_running() const { return _is_running; }
 
-	void push_frame(const void *data, size_t length)
+	recording_state state() const
+	{
+		if (_writer != nullptr)
+			return _writer->state;
+
+		return _finalizing.empty() ? recording_state::idle : recording_state::finalizing;
+	}
+
+	bool is_finalizing(string_view filename) const
 	{
-		_ffmpeg.send_input(data, length);
+		return std::any_of(_finalizing.begin(), _finalizing.end(), [&](auto &w) { return w->filename == filename; });
 	}
 
+	recording_counters counters() const
+	{
+		if (_writer == nullptr)
+			return _counters;
+
+		return { _writer->queue.queued(), _writer->queue.dropped(), _writer->start_latency_ms };
+	}
+
+	// See encoder::speed, as of a fraction of a second ago.
+	std::optional<double> encoder_speed() const
+	{
+		const double speed = _writer != nullptr ? _writer->speed.load(std::memory_order_relaxed) : -1.0;
+		return speed >= 0.0 ? std::optional(speed) : std::nullopt;
+	}
+
+	// Copies the frame without row padding, may block depending on queue policy.
+	// Must not be larger than 'frame_size' passed to start.
+	void push_frame(const void *data, size_t row_pitch, size_t row_size, size_t rows, uint32_t repeat = 1)
+	{
+		stage_timer timer(_stats.get(), stage::push);
+
+		if (!_writer->queue.push(data, row_pitch, row_size, rows, repeat) && _writer->queue.is_closed())
+		{
+			_writer->error_reported = true;
+			std::rethrow_exception(_writer->error);
+		}
+	}
+
+	// See frame_queue::room.
+	size_t room() const { return _writer->queue.room(); }
+
+	// Frames waiting for the writer.
+	size_t queue_depth() const { return _writer != nullptr ? _writer->queue.size() : 0; }
+
+	void drop_frame() { _writer->queue.drop(); }
+
+	/// <summary>
+	/// Returns right away, the writer drains queued frames and finishes the encoder in the background.
+	/// Use poll() to learn how that went.
+	/// </summary>
 	void stop();
+
+	/// <summary>
+	/// Calls <paramref name="on_finished"/> with the file name, counters, and error if any, of each stopped recording
+	/// that is done finalizing. With <paramref name="wait"/>, waits for all of them.
+	/// </summary>
+	void poll(const std::function<void(const std::string &, recording_counters, std::exception_ptr)> &on_finished, bool wait = false);
+
+private:
+	static void write_frames(writer &w);
 };
 
-void recording::start(string_view executable, string_view filename, string_view input_options, string_view output_options)
+ffmpeg_encoder::ffmpeg_encoder(string_view executable, string_view filename, const video_format &format, string_view output_options,
+							   size_t frame_size, const transport_options &transport)
 {
-	assert(!is_running());
+	std::string color_options;
+	if (!format.color_space.empty())
+		color_options = std::format(" -colorspace {} -color_range {}", format.color_space, format.color_range);
+
+	auto cmd = std::format("\"{}\" -f rawvideo -y -r {} -pixel_format {}{} -video_size {}x{} -i - {} -- \"{}\"",
+						   executable, format.framerate, format.pixel_format, color_options, format.width, format.height,
+						   output_options, filename);
+	log_debug("{}", cmd);
+
+	_filename = filename;
+	_logfile = _filename + ".log";
 
 	try
 	{
-		auto cmd = std::format("\"{}\" -f rawvideo -y {} -i - {} -- \"{}\"",
-							   executable, input_options, output_options, filename);
-		log_debug("{}", cmd);
+		_ffmpeg.redirect_input(std::min(transport.pipe_buffer_size, max_pipe_buffer_size));
+		_ffmpeg.redirect_output(_logfile.c_str());
 
-		_logfile = std::string(filename) + ".log";
+		// The relay's errors go to FFmpeg's log, which is only open until FFmpeg starts.
+		if (!transport.relay.empty())
+			_relay.redirect_errors(_ffmpeg);
 
-		_ffmpeg.redirect_input();
-		_ffmpeg.redirect_output(_logfile.c_str());
 		_ffmpeg.start(nullptr, cmd.data());
+
+		if (!transport.relay.empty())
+		{
+			// FFmpeg only reads from pipes, so another process moves frames from shared memory into its input.
+			// Pipe writes and their stalls then happen outside the game, which only copies into the ring.
+			static std::atomic<uint32_t> ring_count = 0;
+			auto name = std::format("Local\\reshade-streams-{}-{}", GetCurrentProcessId(), ring_count++);
+
+			// Converted frames are never larger.
+			_ring = std::make_unique<shared_ring_writer>(name, shared_slots, frame_size);
+
+			auto relay_cmd = std::format("\"{}\" {} {}", transport.relay, name, GetCurrentProcessId());
+			log_debug("{}", relay_cmd);
+
+			_relay.redirect_output(_ffmpeg);
+			_relay.start(nullptr, relay_cmd.data());
+		}
 	}
 	catch (...)
 	{
+		_relay.close();
 		_ffmpeg.close();
 		throw;
 	}
-
-	_is_running = true;
 }
 
-void recording::stop()
+void ffmpeg_encoder::write(std::span<const std::byte> frame, bool more)
 {
-	if (!is_running())
-		return;
+	if (_ring)
+	{
+		_ring->write(frame, _relay.handle());
+	}
+	else if (frame.size() <= batch_frame_size)
+	{
+		// Small frames cost more in system calls than in copying.
+		if (_batch.size() + frame.size() > batch_size)
+			flush_batch();
 
-	_is_running = false;
+		_batch.insert(_batch.end(), frame.begin(), frame.end());
+
+		// Do not hold frames back while waiting for the next one.
+		if (!more)
+			flush_batch();
+	}
+	else
+	{
+		flush_batch();
+		_ffmpeg.send_input(frame.data(), frame.size());
+	}
+}
 
+void ffmpeg_encoder::flush_batch()
+{
+	if (!_batch.empty())
+		_ffmpeg.send_input(_batch.data(), _batch.size());
+	_batch.clear();
+}
+
+void ffmpeg_encoder::finish()
+{
+	int relay_exit_code = 0;
 	int exit_code;
 
+	// Frames are only held back while more are queued, so anything left is from a failed write.
+	_batch.clear();
+
 	try
 	{
+		// The relay drains the ring, then closes FFmpeg's input.
+		if (_ring)
+		{
+			_ring->close();
+			relay_exit_code = _relay.wait_for_exit();
+		}
+
 		exit_code = _ffmpeg.wait_for_exit();
 	}
 	catch (...)
 	{
+		_relay.close();
 		_ffmpeg.close();
 		throw;
 	}
 
+	_relay.close();
 	_ffmpeg.close();
 
+	if (relay_exit_code != 0) {
+		auto message = std::format("Relay exited with code {}, check '{}' for details.", relay_exit_code, _logfile);
+		throw recording_error(message);
+	}
+
 	if (exit_code != 0) {
 		auto message = std::format("FFmpeg exited with code {}, check '{}' for details.", exit_code, _logfile);
 		throw recording_error(message);
 	}
 }
 
+void ffmpeg_encoder::rename(string_view filename)
+{
+	std::string destination(filename);
+
+	move_file(_filename, destination);
+
+	if (GetFileAttributesA(_logfile.c_str()) != INVALID_FILE_ATTRIBUTES)
+		move_file(_logfile, destination + ".log");
+
+	_filename = destination;
+	_logfile = destination + ".log";
+}
+
+std::optional<double> ffmpeg_encoder::speed()
+{
+	// FFmpeg rewrites its progress line in the log, the end of it is enough.
+	return parse_ffmpeg_speed(read_file_tail(_logfile, 4096));
+}
+
+// Inserted before the extension, so FFmpeg still picks the container from it.
+std::string temporary_filename(string_view filename)
+{
+	static std::atomic<uint32_t> count = 0;
+
+	size_t extension = filename.find_last_of('.');
+	if (extension == string_view::npos || filename.find_first_of("/\\", extension) != string_view::npos)
+		extension = filename.size();
+
+	return std::format("{}.warming-{}-{}{}", filename.substr(0, extension), GetCurrentProcessId(), count++, filename.substr(extension));
+}
+
+void encoder_pool::warm(std::string key, string_view filename, encoder_factory make_encoder)
+{
+	if (has(key))
+		return;
+
+	clear();
+
+	std::string output_filename = temporary_filename(filename);
+	log_debug("Starting encoder ahead for '{}'.", filename);
+
+	auto output = std::async(std::launch::async, std::move(make_encoder), output_filename);
+
+	_key = std::move(key);
+	_warm = std::make_unique<warm_encoder>(std::move(output_filename), std::move(output));
+}
+
+std::optional<warm_encoder> encoder_pool::take(string_view key)
+{
+	if (!has(key))
+		return std::nullopt;
+
+	warm_encoder warm = std::move(*_warm);
+	_warm.reset();
+	_key.clear();
+
+	return warm;
+}
+
+void encoder_pool::clear()
+{
+	if (!_warm)
+		return;
+
+	// FFmpeg exits on empty input, which may take a moment.
+	_discarding.push_back(std::async(std::launch::async, [warm = std::move(*_warm)]() mutable {
+		try
+		{
+			warm.output.get()->finish();
+		}
+		catch (std::exception &)
+		{
+			// Expected, there were no frames.
+		}
+
+		DeleteFileA(warm.filename.c_str());
+		DeleteFileA((warm.filename + ".log").c_str());
+	}));
+
+	_warm.reset();
+	_key.clear();
+}
+
+void encoder_pool::poll()
+{
+	std::erase_if(_discarding, [](auto &f) { return f.wait_for(std::chrono::seconds(0)) == std::future_status::ready; });
+}
+
+void recording::start(string_view filename, encoder_factory make_encoder, size_t frame_size, size_t queue_size, queue_policy policy,
+					  std::unique_ptr<frame_converter> converter)
+{
+	assert(!is_running());
+
+	_writer = std::make_unique<writer>(queue_size, frame_size, policy);
+	_writer->filename = filename;
+	_writer->output_filename = filename;
+	_writer->make_encoder = std::move(make_encoder);
+	_writer->converter = std::move(converter);
+	_writer->stats = _stats;
+	_writer->thread = std::thread(write_frames, std::ref(*_writer));
+
+	_is_running = true;
+}
+
+void recording::start(string_view filename, warm_encoder warm, size_t frame_size, size_t queue_size, queue_policy policy,
+					  std::unique_ptr<frame_converter> converter)
+{
+	// The writer thread waits for it, if it is still starting.
+	auto output = std::make_shared<std::future<std::unique_ptr<encoder>>>(std::move(warm.output));
+	start(filename, [output](string_view) { return output->get(); }, frame_size, queue_size, policy, std::move(converter));
+
+	_writer->output_filename = std::move(warm.filename);
+}
+
+void recording::write_frames(writer &w)
+{
+	try
+	{
+		try
+		{
+			w.output = w.make_encoder(w.output_filename);
+		}
+		catch (std::exception &)
+		{
+			std::throw_with_nested(recording_error("Could not start encoder."));
+		}
+
+		w.state = recording_state::running;
+
+		std::span<const std::byte> frame;
+		uint32_t repeat;
+
+		// Asking the encoder may read its log, so not for every frame.
+		constexpr auto speed_interval = std::chrono::milliseconds(250);
+		auto speed_checked = std::chrono::steady_clock::now();
+
+		while (w.queue.pop(frame, repeat))
+		{
+			if (auto now = std::chrono::steady_clock::now(); now - speed_checked >= speed_interval)
+			{
+				speed_checked = now;
+				w.speed.store(w.output->speed().value_or(-1.0), std::memory_order_relaxed);
+			}
+
+			// Converting here keeps the work off the render thread and shrinks what goes to the encoder.
+			if (w.converter)
+			{
+				stage_timer timer(w.stats.get(), stage::convert);
+				frame = w.converter->convert(frame);
+			}
+
+			// Repeated frames are queued once.
+			{
+				stage_timer timer(w.stats.get(), stage::encode);
+
+				w.output->write_repeated(frame, repeat, w.queue.size() != 0);
+			}
+
+			if (w.stats)
+				w.stats->add_bytes(uint64_t(frame.size()) * repeat);
+
+			if (w.start_latency_ms < 0.0)
+			{
+				std::chrono::duration<double, std::milli> latency = std::chrono::steady_clock::now() - w.started;
+				w.start_latency_ms = latency.count();
+			}
+		}
+
+		w.state = recording_state::finalizing;
+	}
+	catch (std::exception &)
+	{
+		w.error = std::current_exception();
+		w.state = recording_state::failed;
+		w.queue.close();
+	}
+
+	try
+	{
+		// Usually explains a write error better, e.g. FFmpeg's exit code.
+		if (w.output)
+			w.output->finish();
+	}
+	catch (std::exception &)
+	{
+		w.finish_error = std::current_exception();
+	}
+
+	try
+	{
+		// Even after an error, so messages name the right file.
+		if (w.output && w.output_filename != w.filename)
+			w.output->rename(w.filename);
+	}
+	catch (std::exception &)
+	{
+		if (!w.finish_error)
+			w.finish_error = std::current_exception();
+	}
+
+	w.done = true;
+}
+
+void recording::stop()
+{
+	if (!is_running())
+		return;
+
+	_is_running = false;
+
+	// Let the writer drain queued frames, without waiting for it.
+	_writer->queue.close();
+
+	_counters = counters();
+	_writer->counters = _counters;
+
+	_finalizing.push_back(std::move(_writer));
+}
+
+void recording::poll(const std::function<void(const std::string &, recording_counters, std::exception_ptr)> &on_finished, bool wait)
+{
+	for (auto it = _finalizing.begin(); it != _finalizing.end();)
+	{
+		writer &w = **it;
+
+		if (!wait && !w.done)
+		{
+			++it;
+			continue;
+		}
+
+		w.thread.join();
+
+		std::exception_ptr error = w.finish_error;
+		if (!error && !w.error_reported)
+			error = w.error;
+		std::string filename = std::move(w.filename);
+		recording_counters counters = w.counters;
+		counters.start_latency_ms = w.start_latency_ms;
+
+		it = _finalizing.erase(it);
+
+		on_finished(filename, counters, error);
+	}
+}
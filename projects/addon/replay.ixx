@@ -0,0 +1,153 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <vector>
+
+export module replay;
+
+import recording;
+
+using frame_data = std::vector<std::byte>;
+
+/// <summary>
+/// A frame of a replay and how many video frames it stands for, see frame_pacer.
+/// </summary>
+export struct replay_frame
+{
+	std::shared_ptr<const frame_data> data;
+	uint32_t repeat = 1;
+};
+
+/// <summary>
+/// The most recent frames of a stream, as many as fit into a memory budget. Older frames are evicted first.
+/// Repeated frames are kept once. Written by the recording's writer thread, read by the render thread.
+/// </summary>
+export class replay_buffer
+{
+private:
+	mutable std::mutex _mutex;
+	std::deque<replay_frame> _frames;
+	std::vector<std::shared_ptr<frame_data>> _spare;  // evicted frames nobody else holds, reused
+	size_t _budget;
+	size_t _used = 0;
+
+public:
+	explicit replay_buffer(size_t budget) : _budget{ budget } {}
+
+	/// <summary>
+	/// Copy a frame in, evicting the oldest frames to stay within budget.
+	/// </summary>
+	void push(std::span<const std::byte> frame, uint32_t repeat);
+
+	/// <summary>
+	/// Frames for the last <paramref name="count"/> video frames, oldest first. They stay valid while held, even once evicted,
+	/// so memory use can exceed the budget while they are saved.
+	/// </summary>
+	std::vector<replay_frame> last(size_t count) const;
+
+	size_t size() const
+	{
+		std::lock_guard lock(_mutex);
+		return _frames.size();
+	}
+
+	size_t memory_used() const
+	{
+		std::lock_guard lock(_mutex);
+		return _used;
+	}
+};
+
+/// <summary>
+/// Hands frames to a replay buffer instead of encoding them.
+/// </summary>
+export class replay_encoder : public encoder
+{
+private:
+	std::shared_ptr<replay_buffer> _buffer;
+
+public:
+	explicit replay_encoder(std::shared_ptr<replay_buffer> buffer) : _buffer{ std::move(buffer) } {}
+
+	void write(std::span<const std::byte> frame, bool) override { _buffer->push(frame, 1); }
+
+	void write_repeated(std::span<const std::byte> frame, uint32_t repeat, bool) override { _buffer->push(frame, repeat); }
+
+	void finish() override {}
+
+	void rename(std::string_view) override {}
+};
+
+void replay_buffer::push(std::span<const std::byte> frame, uint32_t repeat)
+{
+	std::shared_ptr<frame_data> data;
+
+	{
+		std::lock_guard lock(_mutex);
+
+		while (!_frames.empty() && _used + frame.size() > _budget)
+		{
+			auto &oldest = _frames.front().data;
+			_used -= oldest->size();
+
+			// Still referenced if it is being saved.
+			if (oldest.use_count() == 1)
+				_spare.push_back(std::const_pointer_cast<frame_data>(std::move(oldest)));
+
+			_frames.pop_front();
+		}
+
+		if (frame.size() > _budget)
+			return;
+
+		if (!_spare.empty())
+		{
+			data = std::move(_spare.back());
+			_spare.pop_back();
+		}
+
+		// Spare memory is outside the budget, so free the others.
+		_spare.clear();
+	}
+
+	// Copy outside the lock, so saving is not held up.
+	if (data == nullptr)
+		data = std::make_shared<frame_data>();
+
+	data->assign(frame.begin(), frame.end());
+
+	std::lock_guard lock(_mutex);
+	_frames.push_back({ std::move(data), repeat });
+	_used += frame.size();
+}
+
+std::vector<replay_frame> replay_buffer::last(size_t count) const
+{
+	std::lock_guard lock(_mutex);
+
+	auto first = _frames.end();
+	size_t covered = 0;
+
+	while (first != _frames.begin() && covered < count)
+	{
+		--first;
+		covered += first->repeat;
+	}
+
+	std::vector<replay_frame> frames(first, _frames.end());
+
+	// The oldest may stand for more than asked for.
+	if (covered > count)
+		frames.front().repeat -= uint32_t(covered - count);
+
+	return frames;
+}
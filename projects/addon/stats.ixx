@@ -0,0 +1,290 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <format>
+#include <string>
+
+export module stats;
+
+import trace;
+
+/// <summary>
+/// Steps a frame goes through, on the render thread up to push, then on the writer thread.
+/// </summary>
+export enum class stage
+{
+	copy,     // recording copies and submitting them, shared by the streams copied together
+	wait,     // waiting for a copy to finish on the GPU
+	map,      // mapping the copy for reading
+	push,     // queueing the frame for the writer, including waits for room
+	convert,  // pixel conversion on the writer thread
+	encode,   // handing the frame to the encoder, e.g. writing to FFmpeg's input
+	count,
+};
+
+export const char *to_string(stage stage)
+{
+	switch (stage)
+	{
+	case stage::copy: return "copy";
+	case stage::wait: return "wait";
+	case stage::map: return "map";
+	case stage::push: return "push";
+	case stage::convert: return "convert";
+	case stage::encode: return "encode";
+	default: return "?";
+	}
+}
+
+/// <summary>
+/// Durations in nanoseconds, in buckets with 8 steps per power of two, so percentiles are within about 6%.
+/// Written by one thread with add(), or several with add_shared(), and read and reset by others. Relaxed atomics keep
+/// probes cheap: a reset while a value is added may leave it half counted, which does not matter for statistics.
+/// </summary>
+export class latency_histogram
+{
+private:
+	static constexpr int sub_bits = 3;
+	static constexpr int linear = 2 << sub_bits;  // values below are their own bucket
+	static constexpr int max_exponent = 40;       // about 18 minutes
+	static constexpr size_t bucket_count = linear + (max_exponent - sub_bits) * (1 << sub_bits);
+
+	std::array<std::atomic<uint64_t>, bucket_count> _buckets = {};
+	std::atomic<uint64_t> _count = 0;
+	std::atomic<uint64_t> _sum = 0;
+	std::atomic<uint64_t> _min = UINT64_MAX;
+	std::atomic<uint64_t> _max = 0;
+
+public:
+	struct summary
+	{
+		uint64_t count = 0;
+		double min = 0.0, mean = 0.0, p50 = 0.0, p99 = 0.0, max = 0.0;  // nanoseconds
+	};
+
+	void add(uint64_t ns)
+	{
+		// Only one thread adds, so plain loads and stores do, without locked instructions.
+		increase(_buckets[bucket(ns)], 1);
+		increase(_count, 1);
+		increase(_sum, ns);
+
+		if (ns < _min.load(std::memory_order_relaxed))
+			_min.store(ns, std::memory_order_relaxed);
+		if (ns > _max.load(std::memory_order_relaxed))
+			_max.store(ns, std::memory_order_relaxed);
+	}
+
+	void add_shared(uint64_t ns)
+	{
+		_buckets[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+		_count.fetch_add(1, std::memory_order_relaxed);
+		_sum.fetch_add(ns, std::memory_order_relaxed);
+
+		uint64_t min = _min.load(std::memory_order_relaxed);
+		while (ns < min && !_min.compare_exchange_weak(min, ns, std::memory_order_relaxed)) {}
+
+		uint64_t max = _max.load(std::memory_order_relaxed);
+		while (ns > max && !_max.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+	}
+
+	summary summarize() const;
+
+	uint64_t count() const { return _count.load(std::memory_order_relaxed); }
+
+	uint64_t sum() const { return _sum.load(std::memory_order_relaxed); }
+
+	void reset();
+
+private:
+	static void increase(std::atomic<uint64_t> &value, uint64_t amount)
+	{
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+
+	static size_t bucket(uint64_t ns)
+	{
+		if (ns < linear)
+			return size_t(ns);
+
+		const int exponent = std::min(int(std::bit_width(ns)) - 1, max_exponent);
+		const size_t step = size_t(ns >> (exponent - sub_bits)) & ((1 << sub_bits) - 1);
+
+		return std::min(linear + size_t(exponent - sub_bits - 1) * (1 << sub_bits) + step, bucket_count - 1);
+	}
+
+	// Middle of the values in a bucket.
+	static double value(size_t index)
+	{
+		if (index < linear)
+			return double(index);
+
+		const int exponent = int(index - linear) / (1 << sub_bits) + sub_bits + 1;
+		const size_t step = (index - linear) % (1 << sub_bits);
+		const double width = std::ldexp(1.0, exponent - sub_bits);
+
+		return std::ldexp(1.0, exponent) + (step + 0.5) * width;
+	}
+};
+
+latency_histogram::summary latency_histogram::summarize() const
+{
+	summary s;
+	s.count = _count.load(std::memory_order_relaxed);
+	if (s.count == 0)
+		return s;
+
+	s.min = double(_min.load(std::memory_order_relaxed));
+	s.max = double(_max.load(std::memory_order_relaxed));
+	s.mean = double(_sum.load(std::memory_order_relaxed)) / s.count;
+
+	// Buckets are read while being written, so percentiles are ranked against their own total.
+	std::array<uint64_t, bucket_count> counts;
+	uint64_t total = 0;
+	for (size_t i = 0; i < bucket_count; i++)
+		total += counts[i] = _buckets[i].load(std::memory_order_relaxed);
+
+	auto percentile = [&](double p) {
+		const uint64_t rank = uint64_t(std::ceil(p * total));
+		uint64_t seen = 0;
+		for (size_t i = 0; i < bucket_count; i++)
+		{
+			seen += counts[i];
+			if (seen >= rank && counts[i] != 0)
+				return std::clamp(value(i), s.min, s.max);
+		}
+		return s.max;
+	};
+
+	s.p50 = percentile(0.50);
+	s.p99 = percentile(0.99);
+
+	return s;
+}
+
+void latency_histogram::reset()
+{
+	for (auto &bucket : _buckets)
+		bucket.store(0, std::memory_order_relaxed);
+
+	_count.store(0, std::memory_order_relaxed);
+	_sum.store(0, std::memory_order_relaxed);
+	_min.store(UINT64_MAX, std::memory_order_relaxed);
+	_max.store(0, std::memory_order_relaxed);
+}
+
+/// <summary>
+/// Time spent in each stage of a stream's recordings and bytes sent to encoders, since the last reset.
+/// Shared by the stream, its readback ring and its recordings' writer threads.
+/// Stages are also traced while tracing, labeled with the stream's name.
+/// </summary>
+export class pipeline_stats
+{
+public:
+	using clock = std::chrono::steady_clock;  // QueryPerformanceCounter on Windows
+
+private:
+	std::string _label;
+	std::array<latency_histogram, size_t(stage::count)> _stages;
+	std::atomic<uint64_t> _bytes = 0;
+	std::atomic<clock::rep> _since = clock::now().time_since_epoch().count();
+
+public:
+	explicit pipeline_stats(std::string label = {}) : _label{ std::move(label) } {}
+
+	void record(stage stage, clock::time_point start, clock::time_point end)
+	{
+		const auto ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+
+		// A stopped recording's writer may still be draining its queue while the next one's starts.
+		if (stage == stage::convert || stage == stage::encode)
+			_stages[size_t(stage)].add_shared(ns);
+		else
+			_stages[size_t(stage)].add(ns);
+
+		trace_event(to_string(stage), start, end, _label);
+	}
+
+	void add_bytes(uint64_t bytes) { _bytes.fetch_add(bytes, std::memory_order_relaxed); }
+
+	latency_histogram::summary summarize(stage stage) const { return _stages[size_t(stage)].summarize(); }
+
+	const latency_histogram &histogram(stage stage) const { return _stages[size_t(stage)]; }
+
+	uint64_t bytes() const { return _bytes.load(std::memory_order_relaxed); }
+
+	/// <summary>
+	/// Bytes per second sent to encoders since the last reset.
+	/// </summary>
+	double throughput() const
+	{
+		std::chrono::duration<double> elapsed = clock::now().time_since_epoch() - clock::duration(_since.load(std::memory_order_relaxed));
+		return elapsed.count() > 0.0 ? _bytes.load(std::memory_order_relaxed) / elapsed.count() : 0.0;
+	}
+
+	void reset()
+	{
+		for (auto &s : _stages)
+			s.reset();
+
+		_bytes.store(0, std::memory_order_relaxed);
+		_since.store(clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+	}
+
+	/// <summary>
+	/// One line per stage that saw frames, times in microseconds.
+	/// </summary>
+	std::string report() const;
+};
+
+std::string pipeline_stats::report() const
+{
+	std::string report = std::format("  {:.1f} MB/s to encoder\n", throughput() / 1e6);
+
+	for (size_t i = 0; i < _stages.size(); i++)
+	{
+		auto s = _stages[i].summarize();
+		if (s.count == 0)
+			continue;
+
+		report += std::format("  {:<8} n={:<7} min={:<8.1f} mean={:<8.1f} p50={:<8.1f} p99={:<8.1f} max={:.1f} us\n",
+							  to_string(stage(i)), s.count, s.min / 1e3, s.mean / 1e3, s.p50 / 1e3, s.p99 / 1e3, s.max / 1e3);
+	}
+
+	return report;
+}
+
+/// <summary>
+/// Records the time until it goes out of scope, unless there are no stats to record to.
+/// </summary>
+export class stage_timer
+{
+private:
+	pipeline_stats *_stats;
+	stage _stage;
+	pipeline_stats::clock::time_point _start;
+
+public:
+	stage_timer(pipeline_stats *stats, stage stage) : _stats{ stats }, _stage{ stage }
+	{
+		if (_stats != nullptr)
+			_start = pipeline_stats::clock::now();
+	}
+
+	stage_timer(const stage_timer &) = delete;
+	stage_timer &operator=(const stage_timer &) = delete;
+
+	~stage_timer()
+	{
+		if (_stats != nullptr)
+			_stats->record(_stage, _start, pipeline_stats::clock::now());
+	}
+};
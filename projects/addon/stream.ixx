@@ -2,13 +2,33 @@ module;
 
 #include "stdafx.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <exception>
 #include <format>
+#include <functional>
+#include <future>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <vector>
 
 export module stream;
 
 import config;
+import frame_queue;
+import libav;
+import monitor;
+import pacer;
+import pixels;
+import raw_encoder;
+import readback;
 import recording;
+import replay;
+import stats;
 import utils;
 
 export struct stream_error : std::runtime_error
@@ -16,36 +36,166 @@ export struct stream_error : std::runtime_error
 	using std::runtime_error::runtime_error;
 };
 
+/// <summary>
+/// When a frame was rendered, the same for all streams.
+/// </summary>
+export struct frame_stamp
+{
+	frame_pacer::clock::time_point time;
+	uint64_t index = 0;  // frames since the runtime was created
+};
+
+/// <summary>
+/// What recording streams do with their frames.
+/// </summary>
+export enum class capture_mode
+{
+	off,
+	record,  // encode to a file
+	replay,  // keep the last frames in memory, see 'replay.save' command
+};
+
 export class stream
 {
 public:
 	reshade::api::effect_texture_variable texture_variable;
 	std::string name;
+	std::string layout;  // set by shaders that convert on the GPU, see 'stream_layout' annotation
 	bool selected = false;
 	std::string ffmpeg_args;
+	std::string conversion = "none";
+	int framerate = 0;  // 0 for the configured framerate
+	std::string group;  // streams in the same group record the same frames, see 'stream_group' annotation
 
 private:
+	// What a recording of this stream needs, worked out from its texture and the configuration.
+	struct recording_setup
+	{
+		reshade::api::resource_desc host_desc;
+		size_t frame_size = 0;
+		queue_policy policy = queue_policy::block;
+		std::function<std::unique_ptr<frame_converter>()> make_converter;  // empty if frames are not converted
+		std::string key;  // equal for setups that can share an encoder
+		encoder_factory make_encoder;
+	};
+
+	// What the warm encoder was set up for, so it is only set up again when that changes.
+	struct warm_inputs
+	{
+		reshade::api::resource resource;
+		config settings;
+		std::string ffmpeg_args;
+		std::string conversion;
+		int framerate;
+		std::string key;  // empty if the setup failed
+	};
+
 	recording _recording;
-	reshade::api::resource _intermediate;
+	readback_ring _readback;
+	encoder_pool _pool;
+	std::optional<warm_inputs> _warm;
+	std::optional<frame_pacer> _pacer;  // with 'ConstantFramerate' option
+	uint64_t _stride = 1;  // otherwise, frames whose index is a multiple of it are recorded
+	int _framerate = 0;  // of the current recording
+	capture_mode _mode = capture_mode::off;  // of the current recording
+	std::shared_ptr<replay_buffer> _replay;
+	encoder_factory _replay_encoder;  // for saving the replay buffer
+	std::string _replay_extension;  // of files it saves
+	std::vector<std::future<std::string>> _replay_saves;
 	std::string _filename;
+	std::shared_ptr<pipeline_stats> _stats = std::make_shared<pipeline_stats>(name);
+	stream_monitor _monitor;
 
 public:
-	stream(reshade::api::effect_texture_variable texture_variable, std::string name)
-		: texture_variable{ texture_variable }, name{ std::move(name) }
-	{}
+	stream(reshade::api::effect_texture_variable texture_variable, std::string name, std::string layout = {}, std::string group = {})
+		: texture_variable{ texture_variable }, name{ std::move(name) }, layout{ std::move(layout) }, group{ std::move(group) }
+	{
+		_readback.set_stats(_stats.get());
+		_recording.set_stats(_stats);
+	}
+
+	/// <summary>
+	/// Time spent in each stage of recording this stream, see the 'stats' command.
+	/// </summary>
+	pipeline_stats &stats() { return *_stats; }
+
+	/// <summary>
+	/// Recent rates of the current or last recording, for the overlay.
+	/// </summary>
+	const stream_monitor &monitor() const { return _monitor; }
 
 	bool is_recording() const { return _recording.is_running(); }
 
-	bool update(reshade::api::effect_runtime *runtime, bool should_record, const config &config);
+	recording_state state() const { return _recording.state(); }
+
+	recording_counters counters() const { return _recording.counters(); }
+
+	capture_mode mode() const { return is_recording() ? _mode : capture_mode::off; }
+
+	/// <summary>
+	/// Start, stop or switch recording as requested, and report recordings and replays that finished in the background.
+	/// Returns whether the stream is recording.
+	/// </summary>
+	bool update(reshade::api::effect_runtime *runtime, capture_mode mode, const config &config, copy_timeline &timeline);
+
+	/// <summary>
+	/// Encode the last <paramref name="seconds"/> of the replay buffer to a new file in the background.
+	/// </summary>
+	void save_replay(double seconds, const config &config);
+
+	/// <summary>
+	/// Record a frame of each of the recording <paramref name="streams"/>. Finished copies are read back first,
+	/// then all copies are recorded into one command list with merged barriers and submitted together.
+	/// Streams skip the copy if they do not record this <paramref name="frame"/>, because it is too early
+	/// for their framerate. Streams that fail stop recording.
+	/// Streams of a group are copied from the same frames, read back and queued or dropped together,
+	/// and stop together when one fails, so the N-th frame of each output is the same game frame.
+	/// </summary>
+	static void record_frames(reshade::api::effect_runtime *runtime, copy_timeline &timeline, std::span<stream *const> streams,
+							  const frame_stamp &frame);
 
 private:
-	void start_recording(reshade::api::effect_runtime *runtime, const config &config);
+	recording_setup prepare(reshade::api::effect_runtime *runtime, const config &config) const;
 
-	void record_frame(reshade::api::effect_runtime *runtime);
+	void start_recording(reshade::api::effect_runtime *runtime, capture_mode mode, const config &config, copy_timeline &timeline);
 
-	void end_recording();
+	// Keep an encoder started for the next recording, see 'WarmEncoder' option.
+	void warm_up(reshade::api::effect_runtime *runtime, const config &config);
 
-	reshade::api::resource get_resource(reshade::api::effect_runtime *runtime)
+	// Raw captures are not a format FFmpeg could pick from the extension, so they get their own.
+	static std::string output_extension(const config &config) { return config.Encoder == "raw" ? "rawvideo" : config.OutputExtension; }
+
+	std::string output_filename(const config &config) const { return config.OutputName + name + '.' + output_extension(config); }
+
+	int effective_framerate(const config &config) const { return framerate > 0 ? framerate : config.Framerate; }
+
+	// Hand off frames whose copy already finished, at least 'min_count' and at most 'max_count'.
+	// Frames beyond 'room' are dropped instead.
+	void read_frames(reshade::api::command_queue *queue, size_t min_count, size_t max_count = SIZE_MAX, size_t room = SIZE_MAX);
+
+	// Same for all streams of a group in step, waiting for the oldest copy only if a ring has no free slot.
+	static void read_group_frames(reshade::api::command_queue *queue, std::span<stream *const> group);
+
+	// Whether to copy this frame, and how many video frames it stands for.
+	uint32_t sample(const frame_stamp &frame)
+	{
+		// Strides count from the shared index, so streams at related rates record the same frames.
+		return _pacer ? _pacer->advance(frame.time) : frame.index % _stride == 0;
+	}
+
+	// After a stream_error while recording a frame.
+	void fail(reshade::api::effect_runtime *runtime);
+
+	void end_recording(reshade::api::effect_runtime *runtime);
+
+	// Add a sample of the recording's totals to the monitor, if it is time for one.
+	void sample_monitor();
+
+	void finished(const std::string &filename, recording_counters counters, std::exception_ptr error);
+
+	void push_frame(const reshade::api::subresource_data &host_data, uint32_t repeat);
+
+	reshade::api::resource get_resource(reshade::api::effect_runtime *runtime) const
 	{
 		reshade::api::device *device = runtime->get_device();
 
@@ -66,21 +216,56 @@ private:
 	}
 };
 
-bool stream::update(reshade::api::effect_runtime *runtime, bool should_record, const config &config)
+bool stream::update(reshade::api::effect_runtime *runtime, capture_mode mode, const config &config, copy_timeline &timeline)
 {
+	_recording.poll([&](auto &filename, auto counters, auto error) { finished(filename, counters, error); });
+	_pool.poll();
+
+	std::erase_if(_replay_saves, [&](auto &save) {
+		if (save.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+			return false;
+
+		try
+		{
+			log_info("Saved replay of '{}' to '{}'.", name, save.get());
+		}
+		catch (std::exception &)
+		{
+			try
+			{
+				std::throw_with_nested(stream_error(std::format("Could not save replay of '{}'.", name)));
+			}
+			catch (stream_error &e)
+			{
+				print_exception(e);
+			}
+		}
+
+		return true;
+	});
+
 	try
 	{
-		if (selected && should_record != is_recording())
+		if (selected && mode != this->mode())
 		{
-			if (should_record)
+			if (is_recording())
 			{
-				start_recording(runtime, config);
+				end_recording(runtime);
 			}
-			else
+
+			if (mode != capture_mode::off)
 			{
-				end_recording();
+				start_recording(runtime, mode, config, timeline);
 			}
 		}
+		else if (selected && config.WarmEncoder && !is_recording())
+		{
+			warm_up(runtime, config);
+		}
+		else if (!selected || !config.WarmEncoder)
+		{
+			_pool.clear();
+		}
 	}
 	catch (stream_error &e)
 	{
@@ -88,35 +273,145 @@ bool stream::update(reshade::api::effect_runtime *runtime, bool should_record, c
 		return false;
 	}
 
-	if (!is_recording())
-		return false;
+	if (is_recording())
+		sample_monitor();
 
-	try
+	return is_recording();
+}
+
+void stream::sample_monitor()
+{
+	const auto now = stream_monitor::clock::now();
+	if (!_monitor.is_due(now))
+		return;
+
+	const recording_counters counters = _recording.counters();
+	const latency_histogram &wait = _stats->histogram(stage::wait);
+	const latency_histogram &map = _stats->histogram(stage::map);
+
+	monitor_totals totals;
+	totals.frames = counters.queued;
+	totals.dropped = counters.dropped;
+	totals.readbacks = map.count();
+	totals.readback_ns = wait.sum() + map.sum();
+	totals.bytes = _stats->bytes();
+	totals.queue_depth = _recording.queue_depth();
+	totals.speed = _recording.encoder_speed();
+
+	_monitor.sample(now, totals);
+}
+
+void stream::record_frames(reshade::api::effect_runtime *runtime, copy_timeline &timeline, std::span<stream *const> streams,
+						   const frame_stamp &frame)
+{
+	reshade::api::command_queue *const queue = runtime->get_command_queue();
+
+	// Streams without a group are groups of one.
+	std::vector<std::vector<stream *>> groups;
+
+	for (stream *s : streams)
 	{
-		record_frame(runtime);
+		auto it = std::find_if(groups.begin(), groups.end(), [&](auto &g) { return !s->group.empty() && g.front()->group == s->group; });
+
+		if (it != groups.end())
+			it->push_back(s);
+		else
+			groups.push_back({ s });
 	}
-	catch (stream_error &e)
+
+	std::vector<stream *> copying;
+	std::vector<reshade::api::resource> sources;
+	std::vector<uint32_t> repeats;
+	copying.reserve(streams.size());
+	sources.reserve(streams.size());
+	repeats.reserve(streams.size());
+
+	for (auto &group : groups)
 	{
-		print_exception(e);
+		try
+		{
+			read_group_frames(queue, group);
+
+			// The first stream decides for the group.
+			stream *const first = group.front();
 
-		// This happens when FFmpeg exits because of invalid input. In that case
-		// the above message doesn't say anything useful, but end_recording() below
-		// fails with more useful error (process exited with nonzero code).
+			for (stream *s : group)
+			{
+				if (s->_framerate != first->_framerate)
+				{
+					throw stream_error(std::format("Streams in group '{}' must record at the same framerate.", first->group));
+				}
+			}
 
-		try {
-			end_recording();
+			// Not copying frames that would be dropped saves the copy and readback too.
+			const uint32_t repeat = first->sample(frame);
+			if (repeat == 0)
+				continue;
+
+			// A slot may still be copied into on the GPU, so a full ring is never copied into. Rings of a group
+			// that is still lining up may stay full for a frame, which is then dropped for all of its streams.
+			if (std::any_of(group.begin(), group.end(), [](stream *s) { return s->_readback.is_full(); }))
+			{
+				for (stream *s : group)
+					s->_recording.drop_frame();
+
+				continue;
+			}
+
+			std::vector<reshade::api::resource> group_sources;
+			for (stream *s : group)
+				group_sources.push_back(s->get_resource(runtime));
+
+			sources.insert(sources.end(), group_sources.begin(), group_sources.end());
+			copying.insert(copying.end(), group.begin(), group.end());
+			repeats.insert(repeats.end(), group.size(), repeat);
 		}
-		catch (stream_error &e) {
+		catch (stream_error &e)
+		{
 			print_exception(e);
+
+			for (stream *s : group)
+				s->fail(runtime);
 		}
+	}
 
-		return false;
+	if (copying.empty())
+		return;
+
+	// Copy stream textures into the next intermediate buffers, read back on a later frame.
+	const auto copy_start = pipeline_stats::clock::now();
+	const uint32_t count = uint32_t(sources.size());
+	const std::vector<reshade::api::resource_usage> shader_resource(count, reshade::api::resource_usage::shader_resource);
+	const std::vector<reshade::api::resource_usage> copy_source(count, reshade::api::resource_usage::copy_source);
+
+	reshade::api::command_list *const cmd_list = queue->get_immediate_command_list();
+	cmd_list->barrier(count, sources.data(), shader_resource.data(), copy_source.data());
+
+	for (uint32_t i = 0; i < count; i++)
+		copying[i]->_readback.copy(cmd_list, sources[i], { frame.index, repeats[i] });
+
+	cmd_list->barrier(count, sources.data(), copy_source.data(), shader_resource.data());
+
+	try
+	{
+		timeline.submit(queue);
+
+		// Copies are recorded and submitted together, so each stream is charged the whole batch.
+		const auto copy_end = pipeline_stats::clock::now();
+		for (stream *s : copying)
+			s->_stats->record(stage::copy, copy_start, copy_end);
 	}
+	catch (std::exception &e)
+	{
+		print_exception(e);
 
-	return true;
+		for (stream *s : copying)
+			s->fail(runtime);
+	}
 }
 
 // Maps to pixel format strings recognized by ffmpeg CLI, also used from addon overlay.
+// Float formats need FFmpeg 6.0 or newer.
 export const char *convert_pixel_format(reshade::api::format fmt)
 {
 	switch (reshade::api::format_to_typeless(fmt))
@@ -125,92 +420,433 @@ export const char *convert_pixel_format(reshade::api::format fmt)
 		return "rgba";
 	case reshade::api::format::b8g8r8a8_typeless:
 		return "bgra";
+	case reshade::api::format::r10g10b10a2_typeless:
+		return "x2bgr10le";  // red in low bits, alpha ignored
+	case reshade::api::format::b10g10r10a2_typeless:
+		return "x2rgb10le";
+	case reshade::api::format::r16g16b16a16_typeless:
+		return fmt == reshade::api::format::r16g16b16a16_float ? "rgbaf16le" : "rgba64le";
+	case reshade::api::format::r32g32b32a32_typeless:
+		return fmt == reshade::api::format::r32g32b32a32_float ? "rgbaf32le" : nullptr;
+	case reshade::api::format::r8_typeless:
+		return "gray";
+	case reshade::api::format::r16_typeless:
+		return fmt == reshade::api::format::r16_float ? nullptr : "gray16le";
+	case reshade::api::format::r32_typeless:
+		return fmt == reshade::api::format::r32_float ? "grayf32le" : nullptr;
 	default:
 		return nullptr;
 	}
 }
 
-void stream::start_recording(reshade::api::effect_runtime *runtime, const config &config)
+stream::recording_setup stream::prepare(reshade::api::effect_runtime *runtime, const config &config) const
 {
-	// Used in potential error messages, so set early.
-	_filename = config.OutputName + name + '.' + config.OutputExtension;
-	log_info("Recording '{}' to '{}'.", name, _filename);
-
 	reshade::api::device *device = runtime->get_device();
 
-	try
+	reshade::api::resource_desc desc = device->get_resource_desc(get_resource(runtime));
+
+	const char *pixel_format = convert_pixel_format(desc.texture.format);
+	if (pixel_format == nullptr)
 	{
-		reshade::api::resource res = get_resource(runtime);
-		reshade::api::resource_desc desc = device->get_resource_desc(get_resource(runtime));
+		throw stream_error("Stream texture has an unsupported pixel format.");
+	}
+
+	auto policy = parse_queue_policy(config.QueuePolicy);
+	if (!policy)
+	{
+		throw stream_error(std::format("Unknown queue policy '{}'.", config.QueuePolicy));
+	}
+
+	if (config.Encoder != "ffmpeg" && config.Encoder != "libav" && config.Encoder != "raw")
+	{
+		throw stream_error(std::format("Unknown encoder '{}'.", config.Encoder));
+	}
+
+	transport_options transport;
+	if (config.Transport == "shared-memory")
+	{
+		transport.relay = config.RelayPath;
+	}
+	else if (config.Transport != "pipe")
+	{
+		throw stream_error(std::format("Unknown transport '{}'.", config.Transport));
+	}
+
+	reshade::api::resource_desc host_desc = {
+		desc.texture.width, desc.texture.height,
+		1, 1,
+		format_to_default_typed(desc.texture.format),
+		1,
+		reshade::api::memory_heap::gpu_to_cpu, reshade::api::resource_usage::copy_dest
+	};
 
-		const char *pixel_format = convert_pixel_format(desc.texture.format);
-		if (pixel_format == nullptr)
+	// Frames are queued without row padding.
+	size_t frame_size = reshade::api::format_row_pitch(host_desc.texture.format, desc.texture.width) * desc.texture.height;
+
+	// A few frames, so FFmpeg can read ahead of the writer.
+	transport.pipe_buffer_size = size_t(std::max(config.PipeBufferFrames, 0)) * frame_size;
+
+	// What the encoder receives, after optional conversion on the writer thread.
+	std::string_view input_format = pixel_format;
+	std::string_view color_space, color_range;
+	std::function<std::unique_ptr<frame_converter>()> make_converter;
+	uint32_t video_height = desc.texture.height;
+
+	if (!layout.empty())
+	{
+		// Planes written one after another by 'STREAM_YUV' in Stream.fxh, so the texture is the raw frame already.
+		if (layout != "yuv420p")
 		{
-			throw stream_error("Stream texture has an unsupported pixel format.");
+			throw stream_error(std::format("Unknown stream layout '{}'.", layout));
 		}
 
-		reshade::api::resource_desc host_desc = {
-			desc.texture.width, desc.texture.height,
-			1, 1,
-			format_to_default_typed(desc.texture.format),
-			1,
-			reshade::api::memory_heap::gpu_to_cpu, reshade::api::resource_usage::copy_dest
+		if (input_format != "gray" || desc.texture.width % 2 != 0 || desc.texture.height % 3 != 0)
+		{
+			throw stream_error("Streams with yuv420p layout must be 8-bit single channel, with an even width and 3/2 of the video height.");
+		}
+
+		if (conversion != "none")
+		{
+			throw stream_error("Streams with a layout are converted by the shader already.");
+		}
+
+		input_format = layout;
+		video_height = desc.texture.height / 3 * 2;
+		color_space = "bt709";
+		color_range = "tv";
+	}
+	else if (conversion == "gray16")
+	{
+		if (desc.texture.format != reshade::api::format::r32_float)
+		{
+			throw stream_error("Only 32-bit float streams can be converted to gray16.");
+		}
+
+		make_converter = [width = desc.texture.width, height = desc.texture.height]() {
+			return std::make_unique<gray16_converter>(width, height);
 		};
+		input_format = "gray16le";
+	}
+	else if (conversion != "none")
+	{
+		auto yuv_layout = parse_yuv_layout(conversion);
+		if (!yuv_layout)
+		{
+			throw stream_error(std::format("Unknown conversion '{}'.", conversion));
+		}
+
+		auto matrix = parse_color_matrix(config.ColorMatrix);
+		if (!matrix)
+		{
+			throw stream_error(std::format("Unknown color matrix '{}'.", config.ColorMatrix));
+		}
 
-		if (!device->create_resource(host_desc, nullptr, reshade::api::resource_usage::copy_dest, &_intermediate))
+		if (config.ColorRange != "limited" && config.ColorRange != "full")
 		{
-			throw stream_error("Failed to create host resource.");
+			throw stream_error(std::format("Unknown color range '{}'.", config.ColorRange));
 		}
 
-		auto input_options = std::format("-r {} -pixel_format {} -video_size {}x{}",
-										 config.Framerate, pixel_format, desc.texture.width, desc.texture.height);
-		auto output_options = std::format("{} {}", config.FFmpegArgs, ffmpeg_args);
+		if (input_format != "rgba" && input_format != "bgra")
+		{
+			throw stream_error("Only 8-bit RGBA and BGRA streams can be converted to YUV.");
+		}
+
+		const bool full_range = config.ColorRange == "full";
+		yuv_coefficients coeffs(*matrix, full_range, input_format == "bgra");
+		make_converter = [width = desc.texture.width, height = desc.texture.height, coeffs, yuv_layout = *yuv_layout]() {
+			return std::make_unique<yuv_converter>(width, height, coeffs, yuv_layout);
+		};
+		input_format = conversion;
 
-		_recording.start(config.FFmpegPath, _filename, input_options, output_options);
+		// Tell the encoder what the converted frames are, so it does not convert again.
+		color_space = *matrix == color_matrix::bt709 ? "bt709" : "smpte170m";
+		color_range = full_range ? "pc" : "tv";
+	}
+
+	auto output_options = std::format("{} {}", config.FFmpegArgs, ffmpeg_args);
+
+	recording_setup setup = { host_desc, frame_size, *policy, std::move(make_converter) };
+
+	const unsigned raw_threads = unsigned(std::max(config.RawCompressionThreads, 0));
+	const unsigned raw_write_depth = unsigned(std::max(config.RawWriteDepth, 0));
+
+	setup.key = std::format("{}|{}|{}|{}x{}|{}|{}|{}|{}|{}|{}|{}|{}|{}", config.Encoder, config.FFmpegPath, output_filename(config),
+							desc.texture.width, video_height, input_format, effective_framerate(config), color_space, color_range,
+							transport.relay, transport.pipe_buffer_size, output_options, raw_threads, raw_write_depth);
+
+	// Runs on another thread, which may outlive this configuration, so everything is copied.
+	setup.make_encoder = [=, width = desc.texture.width, framerate = effective_framerate(config), encoder = config.Encoder,
+						  executable = config.FFmpegPath, pixel_format = std::string(input_format),
+						  color_space = std::string(color_space), color_range = std::string(color_range),
+						  relay = std::string(transport.relay), pipe_buffer_size = transport.pipe_buffer_size](std::string_view filename) -> std::unique_ptr<encoder>
+	{
+		video_format format = { width, video_height, pixel_format, framerate, color_space, color_range };
+
+		if (encoder == "libav")
+			return make_libav_encoder(filename, format, output_options);
+
+		if (encoder == "raw")
+			return make_raw_encoder(filename, format, raw_threads, raw_write_depth);
+
+		return std::make_unique<ffmpeg_encoder>(executable, filename, format, output_options, frame_size, transport_options{ relay, pipe_buffer_size });
+	};
+
+	return setup;
+}
+
+void stream::start_recording(reshade::api::effect_runtime *runtime, capture_mode mode, const config &config, copy_timeline &timeline)
+{
+	// Used in potential error messages, so set early. Replays name their files when saved.
+	_filename = mode == capture_mode::replay ? std::string() : output_filename(config);
+	_monitor.clear();
+
+	if (mode == capture_mode::replay)
+		log_info("Buffering '{}' for replay.", name);
+	else
+		log_info("Recording '{}' to '{}'.", name, _filename);
+
+	if (!_filename.empty() && _recording.is_finalizing(_filename))
+	{
+		// Rare, but two encoders must not write the same file.
+		log_info("Waiting for the previous recording to '{}' to finish.", _filename);
+		_recording.poll([&](auto &filename, auto counters, auto error) { finished(filename, counters, error); }, true);
+	}
+
+	try
+	{
+		recording_setup setup = prepare(runtime, config);
+
+		_pacer.reset();
+		_stride = 1;
+
+		if (config.ConstantFramerate)
+		{
+			if (effective_framerate(config) <= 0)
+			{
+				throw stream_error("Constant framerate needs a framerate.");
+			}
+
+			_pacer.emplace(effective_framerate(config));
+		}
+		else if (framerate > 0 && framerate != config.Framerate)
+		{
+			// Frames are assumed to come at the configured framerate, so only whole strides keep the timing.
+			if (config.Framerate <= 0 || config.Framerate % framerate != 0)
+			{
+				throw stream_error(std::format("Stream framerate {} must divide the framerate {}, or use constant framerate.",
+											   framerate, config.Framerate));
+			}
+
+			_stride = config.Framerate / framerate;
+		}
+
+		_framerate = effective_framerate(config);
+		_mode = mode;
+
+		_readback.create(timeline, setup.host_desc, config.ReadbackDepth);
+
+		const size_t queue_size = std::max(config.QueueSize, 1);
+		auto converter = setup.make_converter ? setup.make_converter() : nullptr;
+
+		if (mode == capture_mode::replay)
+		{
+			if (_framerate <= 0)
+			{
+				throw stream_error("Replay needs a framerate.");
+			}
+
+			// Frames are kept as the encoder would get them, converted already.
+			_replay = std::make_shared<replay_buffer>(size_t(std::max(config.ReplayMemory, 1)) * 1024 * 1024);
+			_replay_encoder = std::move(setup.make_encoder);
+			_replay_extension = output_extension(config);
+
+			auto make_encoder = [replay = _replay](std::string_view) { return std::make_unique<replay_encoder>(replay); };
+			_recording.start(_filename, std::move(make_encoder), setup.frame_size, queue_size, setup.policy, std::move(converter));
+		}
+		else if (auto warm = _pool.take(setup.key))
+		{
+			log_debug("Using encoder started ahead for '{}'.", name);
+			_recording.start(_filename, std::move(*warm), setup.frame_size, queue_size, setup.policy, std::move(converter));
+		}
+		else
+		{
+			_recording.start(_filename, std::move(setup.make_encoder), setup.frame_size, queue_size, setup.policy, std::move(converter));
+		}
 	}
 	catch (std::exception &)
 	{
-		device->destroy_resource(_intermediate);
+		_readback.destroy();
 
 		auto message = std::format("Could not start recording stream '{}'.", name);
 		std::throw_with_nested(stream_error(message));
 	}
 }
 
-void stream::record_frame(reshade::api::effect_runtime *runtime)
+void stream::warm_up(reshade::api::effect_runtime *runtime, const config &config)
 {
-	reshade::api::device *device = runtime->get_device();
+	recording_setup setup;
 
 	try
 	{
-		reshade::api::resource res = get_resource(runtime);
-		reshade::api::resource_desc desc = device->get_resource_desc(res);
+		// Checked every frame, so the setup is only worked out again when something it depends on changed,
+		// or the encoder was taken by a recording.
+		const reshade::api::resource resource = get_resource(runtime);
+
+		if (_warm && _warm->resource == resource && _warm->settings == config && _warm->ffmpeg_args == ffmpeg_args &&
+			_warm->conversion == conversion && _warm->framerate == framerate && (_warm->key.empty() || _pool.has(_warm->key)))
+			return;
+
+		_warm = { resource, config, ffmpeg_args, conversion, framerate };
+
+		setup = prepare(runtime, config);
+	}
+	catch (stream_error &)
+	{
+		// Reported when recording starts.
+		_pool.clear();
+		return;
+	}
+
+	_warm->key = setup.key;
+
+	if (!_pool.has(setup.key))
+		_pool.warm(std::move(setup.key), output_filename(config), std::move(setup.make_encoder));
+}
+
+void stream::save_replay(double seconds, const config &config)
+{
+	if (mode() != capture_mode::replay)
+	{
+		throw stream_error(std::format("Stream '{}' is not buffering a replay.", name));
+	}
+
+	// More seconds than are buffered, e.g. INT_MAX from 'replay.save' without a duration, save all of it.
+	const double count = std::ceil(seconds * _framerate);
+	auto frames = _replay->last(count < double(UINT32_MAX) ? size_t(count) : SIZE_MAX);
+	if (frames.empty())
+	{
+		throw stream_error(std::format("Replay buffer of '{}' is empty.", name));
+	}
+
+	const auto now = std::chrono::floor<std::chrono::milliseconds>(std::chrono::system_clock::now());
+	auto filename = std::format("{}{}-replay-{:%Y%m%d-%H%M%S}.{}", config.OutputName, name, now, _replay_extension);
+
+	size_t frame_count = 0;
+	for (auto &frame : frames)
+		frame_count += frame.repeat;
+
+	log_info("Saving {} frames of '{}' to '{}'.", frame_count, name, filename);
+
+	// Encoding takes a while, the buffer keeps going meanwhile.
+	_replay_saves.push_back(std::async(std::launch::async, [make_encoder = _replay_encoder, filename, frames = std::move(frames)]() {
+		std::unique_ptr<encoder> output = make_encoder(filename);
+
+		for (size_t i = 0; i < frames.size(); i++)
+			output->write_repeated(*frames[i].data, frames[i].repeat, i + 1 < frames.size());
+
+		output->finish();
+
+		return filename;
+	}));
+}
+
+void stream::read_group_frames(reshade::api::command_queue *queue, std::span<stream *const> group)
+{
+	if (group.size() == 1)
+	{
+		stream *s = group.front();
+		s->read_frames(queue, s->_readback.is_full() ? 1 : 0);
+		return;
+	}
+
+	// A stream that joined the group while recording has none of the copies made before, and a stream may have missed
+	// a copy. Copies of frames not all streams have are read on their own, oldest first, until the oldest pending copies
+	// are of the same frame. Those are older than the newest of them, which was submitted already, so waiting is short.
+	while (true)
+	{
+		uint64_t first_shared = 0;
 
-		// Copy stream texture into intermediate buffer.
+		for (const stream *s : group)
+		{
+			if (s->_readback.pending() == 0)
+				first_shared = UINT64_MAX;
+			else
+				first_shared = std::max(first_shared, s->_readback.pending_info(0).frame_index);
+		}
 
-		reshade::api::command_list *const cmd_list = runtime->get_command_queue()->get_immediate_command_list();
-		cmd_list->barrier(res, reshade::api::resource_usage::shader_resource, reshade::api::resource_usage::copy_source);
-		cmd_list->copy_texture_region(res, 0, nullptr, _intermediate, 0, nullptr);
-		cmd_list->barrier(res, reshade::api::resource_usage::copy_source, reshade::api::resource_usage::shader_resource);
+		if (first_shared == UINT64_MAX)
+		{
+			// None of the pending copies are shared, read the ones that are done, and one of each full ring.
+			for (stream *s : group)
+				s->read_frames(queue, s->_readback.is_full() ? 1 : 0, SIZE_MAX, s->_recording.room());
 
-		runtime->get_command_queue()->flush_immediate_command_list();
-		runtime->get_command_queue()->wait_idle();
+			return;
+		}
 
-		// Map intermediate buffer into CPU address space.
+		bool aligned = true;
 
-		reshade::api::subresource_data host_data;
-		if (!device->map_texture_region(_intermediate, 0, nullptr, reshade::api::map_access::read_only, &host_data))
+		for (stream *s : group)
 		{
-			throw stream_error("Could not access stream texture data.");
+			if (s->_readback.pending_info(0).frame_index < first_shared)
+			{
+				s->read_frames(queue, 1, 1, s->_recording.room());
+				aligned = false;
+			}
 		}
 
-		context_manager unmap_texture_region([&] { device->unmap_texture_region(_intermediate, 0); });
+		if (aligned)
+			break;
+	}
 
-		// Send intermediate buffer contents to recording.
-		// Assumes resource properties match video parameters and fails horribly if not.
+	// Copies of a group finish together. Take as many as all streams have.
+	size_t count = SIZE_MAX;
+	size_t available = SIZE_MAX;
+	size_t room = SIZE_MAX;
+	bool full = false;
 
-		size_t frame_size = host_data.row_pitch * desc.texture.height;
-		_recording.push_frame(host_data.data, frame_size);
+	for (stream *s : group)
+	{
+		count = std::min(count, s->_readback.completed(queue));
+		available = std::min(available, s->_readback.pending());
+		room = std::min(room, s->_recording.room());
+		full |= s->_readback.is_full();
+	}
+
+	if (full)
+		count = std::max<size_t>(count, 1);
+
+	count = std::min(count, available);
+
+	// Up to a copy one of the streams missed, lined up again on the next frame. The oldest are of the same frame.
+	const stream *first = group.front();
+
+	for (size_t i = 1; i < count; i++)
+	{
+		const uint64_t frame_index = first->_readback.pending_info(i).frame_index;
+
+		if (std::any_of(group.begin(), group.end(), [&](const stream *s) { return s->_readback.pending_info(i).frame_index != frame_index; }))
+		{
+			count = i;
+			break;
+		}
+	}
+
+	for (stream *s : group)
+		s->read_frames(queue, count, count, room);
+}
+
+void stream::read_frames(reshade::api::command_queue *queue, size_t min_count, size_t max_count, size_t room)
+{
+	try
+	{
+		size_t index = 0;
+
+		_readback.read(queue, min_count, max_count, [&](auto &host_data, const copy_info &info) {
+			if (index++ < room)
+				push_frame(host_data, info.repeat);
+			else
+				_recording.drop_frame();
+		});
 	}
 	catch (std::exception &)
 	{
@@ -219,12 +855,56 @@ void stream::record_frame(reshade::api::effect_runtime *runtime)
 	}
 }
 
-void stream::end_recording()
+void stream::fail(reshade::api::effect_runtime *runtime)
+{
+	// This happens when FFmpeg exits because of invalid input. In that case
+	// the previous message doesn't say anything useful, but end_recording() below
+	// fails with more useful error (process exited with nonzero code).
+	// Frames still in the readback ring are discarded, they would fail the same way.
+
+	_readback.destroy();
+
+	try {
+		end_recording(runtime);
+	}
+	catch (stream_error &e) {
+		print_exception(e);
+	}
+}
+
+void stream::push_frame(const reshade::api::subresource_data &host_data, uint32_t repeat)
+{
+	// Send intermediate buffer contents to recording. Drivers may pad rows (e.g. to 256 bytes on D3D12),
+	// which FFmpeg does not expect, so only the pixels are copied.
+
+	const reshade::api::resource_desc &desc = _readback.desc();
+	size_t row_size = reshade::api::format_row_pitch(desc.texture.format, desc.texture.width);
+	_recording.push_frame(host_data.data, host_data.row_pitch, row_size, desc.texture.height, repeat);
+}
+
+void stream::end_recording(reshade::api::effect_runtime *runtime)
 {
 	try
 	{
+		// Hand off frames still in flight. FFmpeg has to be stopped even if that fails.
+		std::exception_ptr flush_error;
+
+		try
+		{
+			_readback.read(runtime->get_command_queue(), _readback.pending(), [&](auto &host_data, const copy_info &info) { push_frame(host_data, info.repeat); });
+		}
+		catch (std::exception &)
+		{
+			flush_error = std::current_exception();
+		}
+
+		_readback.destroy();
 		_recording.stop();
-		log_info("Stopped recording '{}' to '{}'.", name, _filename);
+
+		if (flush_error)
+			std::rethrow_exception(flush_error);
+
+		log_info("Finalizing recording '{}' to '{}'.", name, _filename);
 	}
 	catch (std::exception &)
 	{
@@ -232,3 +912,39 @@ void stream::end_recording()
 		std::throw_with_nested(stream_error(message));
 	}
 }
+
+void stream::finished(const std::string &filename, recording_counters counters, std::exception_ptr error)
+{
+	if (!error && filename.empty())
+	{
+		log_info("Stopped replay buffer of '{}'.", name);
+		return;
+	}
+
+	if (!error)
+	{
+		std::string latency;
+		if (counters.start_latency_ms >= 0.0)
+			latency = std::format(", first frame after {:.0f} ms", counters.start_latency_ms);
+
+		log_info("Stopped recording '{}' to '{}' ({} frames, {} dropped{}).", name, filename, counters.queued, counters.dropped, latency);
+		return;
+	}
+
+	try
+	{
+		try
+		{
+			std::rethrow_exception(error);
+		}
+		catch (std::exception &)
+		{
+			auto message = std::format("Could not stop recording '{}' properly, output '{}' may be corrupted.", name, filename);
+			std::throw_with_nested(stream_error(message));
+		}
+	}
+	catch (stream_error &e)
+	{
+		print_exception(e);
+	}
+}
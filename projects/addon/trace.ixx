@@ -0,0 +1,233 @@
+module;
+
+#include "stdafx.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+export module trace;
+
+// Events of each thread go to a ring of its own, so recording one takes no lock. The newest events are kept.
+// Rings are owned by the registry as well, so events of threads that exited can still be exported.
+// Only a ring's thread writes to it, also to start over when it sees a new tracing session.
+
+export struct trace_error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+namespace trace
+{
+	using clock = std::chrono::steady_clock;
+
+	struct event
+	{
+		const char *name;  // static string
+		clock::rep start;
+		clock::rep end;
+		char arg[24];  // copied, e.g. a stream name, which may be gone by the time it is exported
+	};
+
+	struct ring
+	{
+		static constexpr size_t capacity = 16384;
+
+		uint32_t thread_id = GetCurrentThreadId();
+		std::vector<event> events = std::vector<event>(capacity);
+		std::atomic<uint64_t> head = 0;  // events written, published after each write
+		std::atomic<uint64_t> session = 0;  // the events are of, published after head is reset for it
+	};
+
+	std::atomic<bool> enabled = false;
+	std::atomic<uint64_t> session = 0;
+
+	std::mutex mutex;
+	std::vector<std::shared_ptr<ring>> rings;
+
+	thread_local std::shared_ptr<ring> local_ring;
+
+	ring &get_ring()
+	{
+		if (local_ring == nullptr)
+		{
+			local_ring = std::make_shared<ring>();
+
+			std::lock_guard lock(mutex);
+			rings.push_back(local_ring);
+		}
+
+		return *local_ring;
+	}
+
+	void append_escaped(std::string &out, std::string_view text)
+	{
+		for (char c : text)
+		{
+			if (c == '"' || c == '\\')
+				out += '\\';
+
+			if (uint8_t(c) < 0x20)
+				out += std::format("\\u{:04x}", c);
+			else
+				out += c;
+		}
+	}
+}
+
+export bool is_tracing() { return trace::enabled.load(std::memory_order_relaxed); }
+
+/// <summary>
+/// Record an event that ran from <paramref name="start"/> to <paramref name="end"/> on this thread, if tracing.
+/// <paramref name="name"/> must be a static string, <paramref name="arg"/> is copied and may be cut short.
+/// </summary>
+export void trace_event(const char *name, trace::clock::time_point start, trace::clock::time_point end, std::string_view arg = {})
+{
+	if (!is_tracing())
+		return;
+
+	trace::ring &ring = trace::get_ring();
+
+	// The ring starts over with the first event of a new session. Its thread resets it, so no write races a reset.
+	const uint64_t session = trace::session.load(std::memory_order_acquire);
+	if (ring.session.load(std::memory_order_relaxed) != session)
+	{
+		ring.head.store(0, std::memory_order_relaxed);
+		ring.session.store(session, std::memory_order_release);
+	}
+
+	// Only this thread writes, the exporter reads up to the published head.
+	const uint64_t head = ring.head.load(std::memory_order_relaxed);
+	trace::event &e = ring.events[head % trace::ring::capacity];
+
+	e.name = name;
+	e.start = start.time_since_epoch().count();
+	e.end = end.time_since_epoch().count();
+
+	const size_t length = std::min(arg.size(), sizeof(e.arg) - 1);
+	std::memcpy(e.arg, arg.data(), length);
+	e.arg[length] = '\0';
+
+	ring.head.store(head + 1, std::memory_order_release);
+}
+
+/// <summary>
+/// Records an event from its construction to the end of its scope, if tracing when constructed.
+/// </summary>
+export class trace_scope
+{
+private:
+	const char *_name;
+	std::string_view _arg;
+	trace::clock::time_point _start;
+	bool _tracing;
+
+public:
+	explicit trace_scope(const char *name, std::string_view arg = {}) : _name{ name }, _arg{ arg }, _tracing{ is_tracing() }
+	{
+		if (_tracing)
+			_start = trace::clock::now();
+	}
+
+	trace_scope(const trace_scope &) = delete;
+	trace_scope &operator=(const trace_scope &) = delete;
+
+	~trace_scope()
+	{
+		if (_tracing)
+			trace_event(_name, _start, trace::clock::now(), _arg);
+	}
+};
+
+/// <summary>
+/// Forget earlier events and start recording new ones.
+/// </summary>
+export void start_tracing()
+{
+	trace::enabled = false;
+
+	{
+		std::lock_guard lock(trace::mutex);
+
+		// Rings only referenced here belong to threads that exited.
+		std::erase_if(trace::rings, [](auto &ring) { return ring.use_count() == 1; });
+	}
+
+	// Rings start over with their thread's next event. A thread still writing an event of the last session finishes it there.
+	trace::session.fetch_add(1, std::memory_order_release);
+	trace::enabled = true;
+}
+
+/// <summary>
+/// Stop recording and write the events as Chrome trace JSON, for chrome://tracing or ui.perfetto.dev.
+/// Returns the number of events written.
+/// </summary>
+export size_t stop_tracing(const std::string &filename)
+{
+	trace::enabled = false;
+
+	std::string json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	size_t count = 0;
+	const uint32_t process_id = GetCurrentProcessId();
+
+	auto microseconds = [](trace::clock::rep ticks) {
+		return std::chrono::duration<double, std::micro>(trace::clock::duration(ticks)).count();
+	};
+
+	{
+		std::lock_guard lock(trace::mutex);
+		const uint64_t session = trace::session.load(std::memory_order_relaxed);
+
+		for (auto &ring : trace::rings)
+		{
+			// Rings of threads without events since tracing started hold those of an earlier session.
+			if (ring->session.load(std::memory_order_acquire) != session)
+				continue;
+
+			const uint64_t head = ring->head.load(std::memory_order_acquire);
+
+			// A thread that checked before tracing stopped may still be overwriting the oldest event.
+			const uint64_t first = head > trace::ring::capacity ? head - trace::ring::capacity + 1 : 0;
+
+			for (uint64_t i = first; i < head; i++)
+			{
+				const trace::event &e = ring->events[i % trace::ring::capacity];
+
+				json += std::format("{}{{\"name\":\"{}\",\"cat\":\"streams\",\"ph\":\"X\",\"pid\":{},\"tid\":{},\"ts\":{:.3f},\"dur\":{:.3f}",
+									count != 0 ? ",\n" : "", e.name, process_id, ring->thread_id, microseconds(e.start), microseconds(e.end - e.start));
+
+				if (e.arg[0] != '\0')
+				{
+					json += ",\"args\":{\"detail\":\"";
+					trace::append_escaped(json, e.arg);
+					json += "\"}";
+				}
+
+				json += '}';
+				count++;
+			}
+		}
+	}
+
+	json += "\n]}\n";
+
+	std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+	file.write(json.data(), std::streamsize(json.size()));
+
+	if (!file)
+	{
+		throw trace_error(std::format("Could not write trace to '{}'.", filename));
+	}
+
+	return count;
+}
@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+import rawvideo;
+
+// Encodes a raw video file written by the addon's raw encoder, by piping its frames to FFmpeg.
+// With several jobs, the frames are split into segments encoded by as many FFmpeg processes at once,
+// then joined without re-encoding. Each segment starts with a keyframe, so segments are whole GOPs.
+
+struct convert_error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+struct convert_options
+{
+	unsigned jobs = 1;
+	std::string ffmpeg = "ffmpeg";  // executable
+	std::string input;
+	std::string output;
+	std::string args;  // FFmpeg output arguments
+};
+
+struct segment
+{
+	uint64_t first_frame;
+	uint64_t frame_count;
+	std::filesystem::path filename;
+};
+
+// Shortest segment, so concatenation does not add more keyframes than needed.
+constexpr uint64_t min_segment_frames = 120;
+
+// Segments per job, so jobs finishing early take over the remaining work.
+constexpr unsigned segments_per_job = 4;
+
+// cmd.exe strips the outer quotes of the whole command line.
+std::string shell_command(const std::string &command)
+{
+	return std::format("\"{}\"", command);
+}
+
+// Quoted so that FFmpeg gets it as one argument, and cmd.exe does not act on it.
+std::string quote_argument(const std::string &arg)
+{
+	if (!arg.empty() && arg.find_first_of(" \t\"&|<>^()") == std::string::npos)
+		return arg;
+
+	std::string quoted = "\"";
+	size_t backslashes = 0;
+
+	for (char c : arg)
+	{
+		if (c == '\\')
+		{
+			backslashes++;
+			continue;
+		}
+
+		// Backslashes only escape when followed by a quote.
+		quoted.append(c == '"' ? 2 * backslashes + 1 : backslashes, '\\');
+		quoted += c;
+		backslashes = 0;
+	}
+
+	quoted.append(2 * backslashes, '\\');
+	quoted += '"';
+
+	return quoted;
+}
+
+std::string ffmpeg_command(const convert_options &options, const rawvideo_format &format, const std::string &output, bool quiet)
+{
+	std::string command = std::format("{} -hide_banner", quote_argument(options.ffmpeg));
+
+	if (quiet)
+		command += " -nostats -loglevel error";
+
+	command += " -f rawvideo";
+
+	if (format.framerate > 0)
+		command += std::format(" -framerate {}", format.framerate);
+
+	if (!format.color_space.empty())
+		command += std::format(" -colorspace {}", format.color_space);
+
+	if (!format.color_range.empty())
+		command += std::format(" -color_range {}", format.color_range);
+
+	command += std::format(" -pixel_format {} -video_size {}x{} -i -{} -y \"{}\"", format.pixel_format, format.width, format.height, options.args, output);
+
+	return command;
+}
+
+void encode(const convert_options &options, const segment &segment, bool quiet)
+{
+	rawvideo_reader reader(options.input);
+	reader.seek(segment.first_frame);
+
+	FILE *ffmpeg = _popen(shell_command(ffmpeg_command(options, reader.format(), segment.filename.string(), quiet)).c_str(), "wb");
+	if (ffmpeg == nullptr)
+	{
+		throw convert_error("Could not start FFmpeg.");
+	}
+
+	std::span<const std::byte> frame;
+	bool written = true;
+
+	for (uint64_t i = 0; written && i < segment.frame_count && reader.read(frame); i++)
+	{
+		written = fwrite(frame.data(), 1, frame.size(), ffmpeg) == frame.size();
+	}
+
+	int exit_code = _pclose(ffmpeg);
+
+	if (!written || exit_code != 0)
+	{
+		throw convert_error(std::format("FFmpeg failed with exit code {} encoding '{}'.", exit_code, segment.filename.string()));
+	}
+}
+
+std::vector<segment> split(const convert_options &options, uint64_t frame_count)
+{
+	const uint64_t segment_count = std::clamp<uint64_t>(frame_count / min_segment_frames, 1, uint64_t(options.jobs) * segments_per_job);
+	const uint64_t segment_frames = (frame_count + segment_count - 1) / segment_count;
+
+	// Next to the output, with its extension, so each is a complete file of the same container.
+	std::filesystem::path output = std::filesystem::absolute(options.output);
+
+	std::vector<segment> segments;
+	for (uint64_t first = 0; first < frame_count; first += segment_frames)
+	{
+		auto filename = output;
+		filename.replace_filename(std::format("{}.part{}{}", output.stem().string(), segments.size(), output.extension().string()));
+
+		segments.push_back({ first, std::min(segment_frames, frame_count - first), filename });
+	}
+
+	return segments;
+}
+
+void encode_parallel(const convert_options &options, const std::vector<segment> &segments)
+{
+	std::atomic<size_t> next = 0;
+	std::atomic<bool> failed = false;
+	std::exception_ptr error;
+	std::mutex mutex;
+
+	std::vector<std::jthread> jobs;
+
+	for (unsigned i = 0; i < std::min<size_t>(options.jobs, segments.size()); i++)
+	{
+		jobs.emplace_back([&]() {
+			for (size_t s = next++; s < segments.size() && !failed; s = next++)
+			{
+				try
+				{
+					encode(options, segments[s], true);
+
+					std::lock_guard lock(mutex);
+					std::cerr << std::format("Encoded segment {} of {}.", s + 1, segments.size()) << std::endl;
+				}
+				catch (...)
+				{
+					std::lock_guard lock(mutex);
+					if (!failed.exchange(true))
+						error = std::current_exception();
+				}
+			}
+		});
+	}
+
+	jobs.clear();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void concatenate(const convert_options &options, const std::vector<segment> &segments)
+{
+	auto list = std::filesystem::path(segments.front().filename).replace_extension(".txt");
+
+	{
+		std::ofstream file(list);
+
+		for (auto &segment : segments)
+		{
+			// Quoted for FFmpeg's concat demuxer.
+			std::string path = segment.filename.string();
+			for (size_t i = path.find('\''); i != std::string::npos; i = path.find('\'', i + 4))
+				path.replace(i, 1, "'\\''");
+
+			file << std::format("file '{}'\n", path);
+		}
+
+		if (!file)
+		{
+			throw convert_error(std::format("Could not write '{}'.", list.string()));
+		}
+	}
+
+	int exit_code = std::system(shell_command(std::format("{} -hide_banner -nostats -loglevel error -f concat -safe 0 -i \"{}\" -c copy -y \"{}\"",
+									quote_argument(options.ffmpeg), list.string(), options.output)).c_str());
+
+	std::error_code ignored;
+	std::filesystem::remove(list, ignored);
+
+	if (exit_code != 0)
+	{
+		throw convert_error(std::format("FFmpeg failed with exit code {} joining segments.", exit_code));
+	}
+}
+
+int convert(const convert_options &options)
+{
+	rawvideo_reader reader(options.input);
+	const rawvideo_format &format = reader.format();
+
+	std::cerr << std::format("{}: {} frames, {}x{} {}", options.input, reader.frame_count(), format.width, format.height, format.pixel_format) << std::endl;
+
+	auto start = std::chrono::steady_clock::now();
+
+	if (options.jobs == 1 || reader.frame_count() < 2 * min_segment_frames)
+	{
+		encode(options, { 0, reader.frame_count(), options.output }, false);
+	}
+	else
+	{
+		auto segments = split(options, reader.frame_count());
+		std::cerr << std::format("Encoding {} segments with {} jobs.", segments.size(), options.jobs) << std::endl;
+
+		auto remove_segments = [&]() {
+			std::error_code ignored;
+			for (auto &segment : segments)
+				std::filesystem::remove(segment.filename, ignored);
+		};
+
+		try
+		{
+			encode_parallel(options, segments);
+			concatenate(options, segments);
+		}
+		catch (...)
+		{
+			remove_segments();
+			throw;
+		}
+
+		remove_segments();
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	std::cerr << std::format("Encoded {} frames in {:.1f} s, {:.1f} fps", reader.frame_count(), elapsed.count(), reader.frame_count() / elapsed.count());
+	if (format.framerate > 0)
+		std::cerr << std::format(", {:.2f}x real time", reader.frame_count() / (elapsed.count() * format.framerate));
+	std::cerr << '.' << std::endl;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	convert_options options;
+	int arg = 1;
+
+	for (; arg + 1 < argc; arg += 2)
+	{
+		const std::string option = argv[arg];
+
+		if (option == "-j")
+		{
+			options.jobs = unsigned(std::strtoul(argv[arg + 1], nullptr, 10));
+			if (options.jobs == 0)
+				options.jobs = std::max(std::thread::hardware_concurrency(), 1u);
+		}
+		else if (option == "--ffmpeg")
+		{
+			options.ffmpeg = argv[arg + 1];
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if (argc - arg < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " [-j <jobs>] [--ffmpeg <path>] <input.rawvideo> <output> [<ffmpeg output argument>]..." << std::endl;
+		std::cerr << "With more than one job, segments are encoded at once and joined. -j 0 uses a job per core." << std::endl;
+		std::cerr << "FFmpeg is found on PATH unless --ffmpeg is given." << std::endl;
+		return 1;
+	}
+
+	options.input = argv[arg];
+	options.output = argv[arg + 1];
+
+	for (int i = arg + 2; i < argc; i++)
+		options.args += std::format(" {}", quote_argument(argv[i]));
+
+	try
+	{
+		return convert(options);
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+}
@@ -0,0 +1,523 @@
+module;
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <format>
+#include <fstream>
+#include <future>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef STREAMS_LZ4
+#include <lz4.h>
+#endif
+
+export module rawvideo;
+
+import direct_file;
+
+export struct rawvideo_error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+/// <summary>
+/// Frames as stored, packed without row padding. Names are those used by FFmpeg.
+/// </summary>
+export struct rawvideo_format
+{
+	uint32_t width = 0;
+	uint32_t height = 0;
+	std::string pixel_format;
+	int framerate = 0;
+	std::string color_space;  // empty if not known
+	std::string color_range;  // "tv" or "pc", empty if not known
+	uint64_t frame_size = 0;
+};
+
+/// <summary>
+/// Whether chunks can be compressed, see 'LZ4Dir' in the project file. Uncompressed files can always be read.
+/// </summary>
+export constexpr bool rawvideo_compression_available =
+#ifdef STREAMS_LZ4
+	true;
+#else
+	false;
+#endif
+
+// File layout: a header, chunks of whole frames, each compressed on its own, then an index of the chunks
+// and a trailer pointing to it. Files cut short, e.g. by a crash, have no index, and are read by scanning chunks.
+namespace rawvideo
+{
+	constexpr uint32_t magic = 0x56575352;        // RSWV
+	constexpr uint32_t chunk_magic = 0x4B4E4843;  // CHNK
+	constexpr uint32_t index_magic = 0x58444E49;  // INDX
+	constexpr uint32_t version = 1;
+
+	enum class compression : uint32_t
+	{
+		none = 0,
+		lz4 = 1,
+	};
+
+	struct header
+	{
+		uint32_t magic = rawvideo::magic;
+		uint32_t version = rawvideo::version;
+		uint32_t width = 0;
+		uint32_t height = 0;
+		uint64_t frame_size = 0;
+		int32_t framerate = 0;
+		uint32_t reserved = 0;
+		char pixel_format[32] = {};
+		char color_space[16] = {};
+		char color_range[8] = {};
+	};
+
+	struct chunk_header
+	{
+		uint32_t magic = chunk_magic;
+		compression method = compression::none;
+		uint64_t first_frame = 0;
+		uint32_t frame_count = 0;
+		uint32_t reserved = 0;
+		uint64_t stored_size = 0;
+	};
+
+	struct index_entry
+	{
+		uint64_t offset = 0;  // of the chunk header
+		uint64_t first_frame = 0;
+		uint32_t frame_count = 0;
+		uint32_t reserved = 0;
+	};
+
+	struct trailer
+	{
+		uint64_t index_offset = 0;
+		uint64_t chunk_count = 0;
+		uint32_t magic = index_magic;
+		uint32_t reserved = 0;
+	};
+
+	struct chunk
+	{
+		chunk_header header;
+		std::vector<std::byte> data;
+	};
+
+	void copy_string(char *dest, size_t size, std::string_view src)
+	{
+		if (src.size() >= size)
+			throw rawvideo_error(std::format("'{}' is too long for the file header.", src));
+
+		std::memcpy(dest, src.data(), src.size());
+	}
+
+	std::string read_string(const char *src, size_t size)
+	{
+		return { src, strnlen(src, size) };
+	}
+
+	chunk compress(std::vector<std::byte> raw, uint64_t first_frame, uint32_t frame_count, bool compress)
+	{
+		chunk c;
+		c.header.first_frame = first_frame;
+		c.header.frame_count = frame_count;
+
+#ifdef STREAMS_LZ4
+		if (compress && raw.size() <= LZ4_MAX_INPUT_SIZE)
+		{
+			c.data.resize(LZ4_compressBound(int(raw.size())));
+
+			int size = LZ4_compress_default(reinterpret_cast<const char *>(raw.data()), reinterpret_cast<char *>(c.data.data()),
+											int(raw.size()), int(c.data.size()));
+
+			// Noise does not compress, it is stored as is then.
+			if (size > 0 && size_t(size) < raw.size())
+			{
+				c.data.resize(size);
+				c.header.method = compression::lz4;
+				c.header.stored_size = c.data.size();
+				return c;
+			}
+		}
+#endif
+
+		c.data = std::move(raw);
+		c.header.stored_size = c.data.size();
+		return c;
+	}
+
+	void decompress(const chunk_header &header, std::span<const std::byte> stored, std::vector<std::byte> &raw, uint64_t frame_size)
+	{
+		raw.resize(frame_size * header.frame_count);
+
+		if (header.method == compression::none)
+		{
+			if (stored.size() != raw.size())
+				throw rawvideo_error("Chunk size does not match its frames.");
+
+			std::memcpy(raw.data(), stored.data(), raw.size());
+			return;
+		}
+
+#ifdef STREAMS_LZ4
+		if (header.method == compression::lz4)
+		{
+			int size = LZ4_decompress_safe(reinterpret_cast<const char *>(stored.data()), reinterpret_cast<char *>(raw.data()),
+										   int(stored.size()), int(raw.size()));
+
+			if (size < 0 || size_t(size) != raw.size())
+				throw rawvideo_error("Chunk is corrupted.");
+
+			return;
+		}
+#endif
+
+		throw rawvideo_error(std::format("Chunk compression {} is not supported by this build.", uint32_t(header.method)));
+	}
+}
+
+/// <summary>
+/// Writes frames into a raw video file, compressing chunks of frames on other threads.
+/// Frames must all have the same size.
+/// </summary>
+export class rawvideo_writer
+{
+private:
+	direct_file_writer _file;
+	rawvideo_format _format;
+	bool _compress;
+	size_t _max_compressing;
+
+	std::vector<std::byte> _chunk;  // frames gathered for the next chunk
+	uint32_t _chunk_frames = 0;
+	uint32_t _frames_per_chunk = 0;
+	uint64_t _frame_count = 0;
+
+	std::deque<std::future<rawvideo::chunk>> _compressing;
+	std::vector<rawvideo::index_entry> _index;
+	uint64_t _offset = 0;
+	uint64_t _stored_size = 0;
+
+	// Small enough to keep threads busy, large enough to compress well.
+	static constexpr size_t chunk_size = 4 * 1024 * 1024;
+
+public:
+	/// <summary>
+	/// With <paramref name="threads"/> at 0, chunks are stored uncompressed.
+	/// <paramref name="write_depth"/> is the number of unbuffered writes in flight, see <see cref="direct_file_writer"/>.
+	/// </summary>
+	rawvideo_writer(const std::string &filename, rawvideo_format format, unsigned threads, unsigned write_depth);
+
+	void write(std::span<const std::byte> frame);
+
+	/// <summary>
+	/// Write what is left, the index and the trailer, and close the file.
+	/// </summary>
+	void finish();
+
+	uint64_t frame_count() const { return _frame_count; }
+
+	uint64_t raw_size() const { return _frame_count * _format.frame_size; }
+
+	uint64_t stored_size() const { return _stored_size; }
+
+private:
+	void write_header();
+
+	void submit_chunk();
+
+	void write_chunk(const rawvideo::chunk &c);
+
+	void write_bytes(const void *data, size_t size);
+};
+
+rawvideo_writer::rawvideo_writer(const std::string &filename, rawvideo_format format, unsigned threads, unsigned write_depth)
+	: _file{ filename, write_depth }, _format{ std::move(format) }, _compress{ threads != 0 }, _max_compressing{ std::max(threads, 1u) }
+{
+}
+
+void rawvideo_writer::write(std::span<const std::byte> frame)
+{
+	// The header needs the frame size, which is known for sure once frames arrive.
+	if (_offset == 0)
+	{
+		_format.frame_size = frame.size();
+		_frames_per_chunk = uint32_t(std::max<size_t>(chunk_size / std::max<size_t>(frame.size(), 1), 1));
+		write_header();
+	}
+
+	if (frame.size() != _format.frame_size)
+	{
+		throw rawvideo_error("Frame size changed.");
+	}
+
+	_chunk.insert(_chunk.end(), frame.begin(), frame.end());
+	_chunk_frames++;
+	_frame_count++;
+
+	if (_chunk_frames == _frames_per_chunk)
+		submit_chunk();
+}
+
+void rawvideo_writer::finish()
+{
+	if (_offset == 0)
+		write_header();
+
+	if (_chunk_frames != 0)
+		submit_chunk();
+
+	while (!_compressing.empty())
+	{
+		write_chunk(_compressing.front().get());
+		_compressing.pop_front();
+	}
+
+	rawvideo::trailer trailer;
+	trailer.index_offset = _offset;
+	trailer.chunk_count = _index.size();
+
+	write_bytes(_index.data(), _index.size() * sizeof(rawvideo::index_entry));
+	write_bytes(&trailer, sizeof(trailer));
+
+	_file.close();
+}
+
+void rawvideo_writer::write_header()
+{
+	rawvideo::header header;
+	header.width = _format.width;
+	header.height = _format.height;
+	header.frame_size = _format.frame_size;
+	header.framerate = _format.framerate;
+	rawvideo::copy_string(header.pixel_format, sizeof(header.pixel_format), _format.pixel_format);
+	rawvideo::copy_string(header.color_space, sizeof(header.color_space), _format.color_space);
+	rawvideo::copy_string(header.color_range, sizeof(header.color_range), _format.color_range);
+
+	write_bytes(&header, sizeof(header));
+}
+
+void rawvideo_writer::submit_chunk()
+{
+	// Chunks are written in order, so wait for the oldest when all threads are busy.
+	while (_compressing.size() >= _max_compressing || (!_compressing.empty() && _compressing.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready))
+	{
+		write_chunk(_compressing.front().get());
+		_compressing.pop_front();
+	}
+
+	std::vector<std::byte> raw;
+	raw.reserve(_frames_per_chunk * _format.frame_size);
+	std::swap(raw, _chunk);
+
+	const uint64_t first_frame = _frame_count - _chunk_frames;
+	_compressing.push_back(std::async(std::launch::async, rawvideo::compress, std::move(raw), first_frame, _chunk_frames, _compress));
+	_chunk_frames = 0;
+}
+
+void rawvideo_writer::write_chunk(const rawvideo::chunk &c)
+{
+	_index.push_back({ _offset, c.header.first_frame, c.header.frame_count });
+
+	write_bytes(&c.header, sizeof(c.header));
+	write_bytes(c.data.data(), c.data.size());
+
+	_stored_size += c.data.size();
+}
+
+void rawvideo_writer::write_bytes(const void *data, size_t size)
+{
+	_file.write(data, size);
+	_offset += size;
+}
+
+/// <summary>
+/// Reads frames from a raw video file, in order or from any frame on.
+/// </summary>
+export class rawvideo_reader
+{
+private:
+	std::ifstream _file;
+	rawvideo_format _format;
+	std::vector<rawvideo::index_entry> _index;
+	uint64_t _frame_count = 0;
+
+	size_t _next_chunk = 0;
+	std::vector<std::byte> _stored;
+	std::vector<std::byte> _chunk;
+	uint32_t _chunk_frames = 0;
+	uint32_t _chunk_position = 0;  // next frame in the chunk
+	uint32_t _skip = 0;  // frames to skip in the next chunk, after seeking
+
+public:
+	explicit rawvideo_reader(const std::string &filename);
+
+	const rawvideo_format &format() const { return _format; }
+
+	uint64_t frame_count() const { return _frame_count; }
+
+	/// <summary>
+	/// Continue reading at <paramref name="frame"/>.
+	/// </summary>
+	void seek(uint64_t frame);
+
+	/// <summary>
+	/// The next frame, valid until the next call. Returns false at the end.
+	/// </summary>
+	bool read(std::span<const std::byte> &frame);
+
+private:
+	template<typename T>
+	void read_value(T &value)
+	{
+		if (!_file.read(reinterpret_cast<char *>(&value), sizeof(T)))
+			throw rawvideo_error("Unexpected end of file.");
+	}
+
+	void load_index(uint64_t file_size);
+
+	void scan_chunks(uint64_t file_size);
+};
+
+rawvideo_reader::rawvideo_reader(const std::string &filename)
+{
+	_file.open(filename, std::ios::binary);
+	if (!_file)
+	{
+		throw rawvideo_error(std::format("Could not open '{}'.", filename));
+	}
+
+	rawvideo::header header;
+	read_value(header);
+
+	if (header.magic != rawvideo::magic)
+	{
+		throw rawvideo_error(std::format("'{}' is not a raw video file.", filename));
+	}
+
+	if (header.version != rawvideo::version)
+	{
+		throw rawvideo_error(std::format("Version {} of raw video files is not supported.", header.version));
+	}
+
+	_format.width = header.width;
+	_format.height = header.height;
+	_format.frame_size = header.frame_size;
+	_format.framerate = header.framerate;
+	_format.pixel_format = rawvideo::read_string(header.pixel_format, sizeof(header.pixel_format));
+	_format.color_space = rawvideo::read_string(header.color_space, sizeof(header.color_space));
+	_format.color_range = rawvideo::read_string(header.color_range, sizeof(header.color_range));
+
+	_file.seekg(0, std::ios::end);
+	const uint64_t file_size = uint64_t(_file.tellg());
+
+	load_index(file_size);
+
+	for (auto &entry : _index)
+		_frame_count = std::max(_frame_count, entry.first_frame + entry.frame_count);
+
+	seek(0);
+}
+
+void rawvideo_reader::load_index(uint64_t file_size)
+{
+	rawvideo::trailer trailer;
+
+	if (file_size >= sizeof(rawvideo::header) + sizeof(trailer))
+	{
+		_file.seekg(file_size - sizeof(trailer));
+		read_value(trailer);
+
+		const uint64_t index_size = trailer.chunk_count * sizeof(rawvideo::index_entry);
+
+		if (trailer.magic == rawvideo::index_magic && trailer.index_offset + index_size + sizeof(trailer) == file_size)
+		{
+			_index.resize(trailer.chunk_count);
+			_file.seekg(trailer.index_offset);
+			if (!_file.read(reinterpret_cast<char *>(_index.data()), std::streamsize(index_size)))
+				throw rawvideo_error("Could not read index.");
+
+			return;
+		}
+	}
+
+	scan_chunks(file_size);
+}
+
+void rawvideo_reader::scan_chunks(uint64_t file_size)
+{
+	// Complete chunks of a file that was not finished.
+	uint64_t offset = sizeof(rawvideo::header);
+
+	while (offset + sizeof(rawvideo::chunk_header) <= file_size)
+	{
+		rawvideo::chunk_header header;
+		_file.seekg(offset);
+		read_value(header);
+
+		const uint64_t end = offset + sizeof(header) + header.stored_size;
+		if (header.magic != rawvideo::chunk_magic || end > file_size)
+			break;
+
+		_index.push_back({ offset, header.first_frame, header.frame_count });
+		offset = end;
+	}
+
+	_file.clear();
+}
+
+void rawvideo_reader::seek(uint64_t frame)
+{
+	auto it = std::find_if(_index.begin(), _index.end(), [&](auto &entry) { return frame < entry.first_frame + entry.frame_count; });
+
+	_next_chunk = size_t(it - _index.begin());
+	_chunk_frames = 0;
+	_chunk_position = 0;
+	_skip = it != _index.end() && frame > it->first_frame ? uint32_t(frame - it->first_frame) : 0;
+}
+
+bool rawvideo_reader::read(std::span<const std::byte> &frame)
+{
+	if (_chunk_position == _chunk_frames)
+	{
+		if (_next_chunk == _index.size())
+			return false;
+
+		const rawvideo::index_entry &entry = _index[_next_chunk++];
+
+		rawvideo::chunk_header header;
+		_file.seekg(entry.offset);
+		read_value(header);
+
+		if (header.magic != rawvideo::chunk_magic)
+		{
+			throw rawvideo_error("Chunk is corrupted.");
+		}
+
+		_stored.resize(header.stored_size);
+		if (!_file.read(reinterpret_cast<char *>(_stored.data()), std::streamsize(_stored.size())))
+		{
+			throw rawvideo_error("Unexpected end of file.");
+		}
+
+		rawvideo::decompress(header, _stored, _chunk, _format.frame_size);
+		_chunk_frames = header.frame_count;
+		_chunk_position = _skip;
+		_skip = 0;
+	}
+
+	frame = std::span<const std::byte>(_chunk).subspan(_chunk_position * _format.frame_size, _format.frame_size);
+	_chunk_position++;
+
+	return true;
+}
@@ -0,0 +1,73 @@
+#include <cstddef>
+#include <iostream>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+#include <Windows.h>
+
+import shared_ring;
+import winutils;
+
+// Started by the addon for recordings using shared memory. Reads frames from the ring
+// and writes them to standard output, which is connected to FFmpeg's standard input.
+
+void write_all(HANDLE output, std::span<const std::byte> data)
+{
+	while (!data.empty())
+	{
+		DWORD bytes_written;
+		win::WriteFile(output, data.data(), DWORD(data.size()), &bytes_written, NULL);
+
+		data = data.subspan(bytes_written);
+	}
+}
+
+bool run(const std::string &name, DWORD writer_id)
+{
+	try
+	{
+		win::unique_data<HANDLE, CloseHandle, INVALID_HANDLE_VALUE> writer = win::OpenProcess(SYNCHRONIZE, FALSE, writer_id);
+		shared_ring_reader ring(name);
+
+		HANDLE output = GetStdHandle(STD_OUTPUT_HANDLE);
+
+		std::span<const std::byte> frame;
+
+		while (ring.read(frame, writer))
+		{
+			write_all(output, frame);
+			ring.release();
+		}
+
+		return true;
+	}
+	catch (std::exception &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return false;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3)
+	{
+		std::cerr << "Usage: " << argv[0] << " <shared memory name> <writer process ID>" << std::endl;
+		return 1;
+	}
+
+	DWORD writer_id;
+
+	try
+	{
+		writer_id = std::stoul(argv[2]);
+	}
+	catch (std::exception &)
+	{
+		std::cerr << "Invalid process ID." << std::endl;
+		return 1;
+	}
+
+	return run(argv[1], writer_id) ? 0 : 1;
+}
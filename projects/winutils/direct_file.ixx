@@ -0,0 +1,251 @@
+module;
+
+#include <Windows.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+export module direct_file;
+
+import winutils;
+
+export struct direct_file_error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+namespace direct_file
+{
+	// Each write, a multiple of any sector size.
+	constexpr size_t buffer_size = 4 * 1024 * 1024;
+
+	// The file is grown ahead of the writes by this much, so it is allocated in large extents.
+	constexpr uint64_t allocation_step = 256 * 1024 * 1024;
+
+	void free_pages(void *pages)
+	{
+		if (pages != nullptr)
+			VirtualFree(pages, 0, MEM_RELEASE);
+	}
+
+	using handle = win::unique_data<HANDLE, win::CloseHandle, INVALID_HANDLE_VALUE>;
+	using pages = win::unique_data<void *, free_pages, nullptr>;
+
+	struct buffer
+	{
+		pages data;
+		handle event;
+		OVERLAPPED overlapped = {};
+		size_t used = 0;
+		DWORD length = 0;  // of the pending write
+		bool pending = false;
+	};
+}
+
+/// <summary>
+/// Sequential file output that bypasses the system cache, for sustained writes of gigabytes per second.
+/// Data is gathered in sector-aligned buffers, written with up to <c>depth</c> overlapped writes in flight.
+/// Only used by one thread.
+/// </summary>
+export class direct_file_writer
+{
+private:
+	direct_file::handle _file;
+	std::vector<direct_file::buffer> _buffers;
+	size_t _current = 0;
+	size_t _sector_size = 4096;
+	bool _unbuffered;
+	uint64_t _offset = 0;     // where the current buffer goes
+	uint64_t _allocated = 0;  // end of file set ahead of the writes
+	uint64_t _size = 0;
+
+public:
+	/// <summary>
+	/// With <paramref name="depth"/> at 0, writes go through the system cache one at a time instead.
+	/// </summary>
+	direct_file_writer(const std::string &filename, unsigned depth);
+
+	~direct_file_writer() { cancel(); }
+
+	direct_file_writer(const direct_file_writer &) = delete;
+	direct_file_writer &operator=(const direct_file_writer &) = delete;
+
+	void write(const void *data, size_t size);
+
+	/// <summary>
+	/// Write what is buffered, wait for all writes, and trim the file to the size written.
+	/// </summary>
+	void close();
+
+	uint64_t size() const { return _size; }
+
+private:
+	void submit(direct_file::buffer &buffer, size_t length);
+
+	void wait(direct_file::buffer &buffer);
+
+	void set_end_of_file(uint64_t size);
+
+	void cancel();
+};
+
+direct_file_writer::direct_file_writer(const std::string &filename, unsigned depth) : _unbuffered{ depth != 0 }
+{
+	DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN;
+	if (_unbuffered)
+		flags |= FILE_FLAG_NO_BUFFERING;
+
+	try
+	{
+		_file = win::CreateFileA(filename.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, flags, NULL);
+	}
+	catch (std::exception &)
+	{
+		std::throw_with_nested(direct_file_error(std::format("Could not create '{}'.", filename)));
+	}
+
+	// Unbuffered writes must be aligned to the volume's sectors, which are at most a page on common drives.
+	FILE_STORAGE_INFO storage = {};
+	if (_unbuffered && GetFileInformationByHandleEx(_file, FileStorageInfo, &storage, sizeof(storage)))
+	{
+		_sector_size = std::max<size_t>(_sector_size, storage.LogicalBytesPerSector);
+
+		if (direct_file::buffer_size % _sector_size != 0)
+			throw direct_file_error(std::format("Sectors of {} bytes are not supported.", _sector_size));
+	}
+
+	_buffers.resize(std::max(depth, 1u));
+
+	for (auto &buffer : _buffers)
+	{
+		// Pages are aligned to any sector size that divides them.
+		buffer.data = win::VirtualAlloc(NULL, direct_file::buffer_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		buffer.event = win::CreateEventA(NULL, TRUE, FALSE, NULL);
+	}
+}
+
+void direct_file_writer::write(const void *data, size_t size)
+{
+	auto bytes = static_cast<const std::byte *>(data);
+	_size += size;
+
+	while (size != 0)
+	{
+		direct_file::buffer &buffer = _buffers[_current];
+
+		const size_t count = std::min(size, direct_file::buffer_size - buffer.used);
+		std::memcpy(static_cast<std::byte *>(static_cast<void *>(buffer.data)) + buffer.used, bytes, count);
+
+		buffer.used += count;
+		bytes += count;
+		size -= count;
+
+		if (buffer.used == direct_file::buffer_size)
+			submit(buffer, buffer.used);
+	}
+}
+
+void direct_file_writer::close()
+{
+	direct_file::buffer &last = _buffers[_current];
+
+	if (last.used != 0)
+	{
+		// Unbuffered writes are whole sectors, the padding is cut off below.
+		size_t length = last.used;
+		if (_unbuffered)
+		{
+			length = (length + _sector_size - 1) / _sector_size * _sector_size;
+			std::memset(static_cast<std::byte *>(static_cast<void *>(last.data)) + last.used, 0, length - last.used);
+		}
+
+		submit(last, length);
+	}
+
+	for (auto &buffer : _buffers)
+		wait(buffer);
+
+	set_end_of_file(_size);
+
+	direct_file::handle closing = std::move(_file);
+}
+
+void direct_file_writer::submit(direct_file::buffer &buffer, size_t length)
+{
+	// Grow the file ahead of the writes, so they do not extend it one at a time.
+	if (_offset + length > _allocated)
+	{
+		_allocated = (_offset + length + direct_file::allocation_step - 1) / direct_file::allocation_step * direct_file::allocation_step;
+		set_end_of_file(_allocated);
+	}
+
+	buffer.overlapped = {};
+	buffer.overlapped.Offset = DWORD(_offset);
+	buffer.overlapped.OffsetHigh = DWORD(_offset >> 32);
+	buffer.overlapped.hEvent = buffer.event;
+	buffer.length = DWORD(length);
+
+	auto res = win::res::WriteFile(_file, buffer.data, buffer.length, nullptr, &buffer.overlapped);
+
+	switch (res.err())
+	{
+	case ERROR_SUCCESS:
+	case ERROR_IO_PENDING:
+		buffer.pending = true;
+		break;
+	default:
+		throw res.make_error();
+	}
+
+	_offset += length;
+	_current = (_current + 1) % _buffers.size();
+
+	// Without a queue, or once it is full, wait for the oldest write to reuse its buffer.
+	wait(_buffers[_current]);
+}
+
+void direct_file_writer::wait(direct_file::buffer &buffer)
+{
+	if (buffer.pending)
+	{
+		buffer.pending = false;
+
+		DWORD written;
+		win::GetOverlappedResult(_file, &buffer.overlapped, &written, TRUE);
+
+		if (written != buffer.length)
+			throw direct_file_error("Could not write to file.");
+	}
+
+	buffer.used = 0;
+}
+
+void direct_file_writer::set_end_of_file(uint64_t size)
+{
+	FILE_END_OF_FILE_INFO info = {};
+	info.EndOfFile.QuadPart = LONGLONG(size);
+
+	win::SetFileInformationByHandle(_file, FileEndOfFileInfo, &info, DWORD(sizeof(info)));
+}
+
+void direct_file_writer::cancel()
+{
+	if (_file == INVALID_HANDLE_VALUE)
+		return;
+
+	// The buffers must outlive the writes.
+	CancelIoEx(_file, NULL);
+
+	for (auto &buffer : _buffers)
+	{
+		DWORD written;
+		if (buffer.pending)
+			GetOverlappedResult(_file, &buffer.overlapped, &written, TRUE);
+	}
+}
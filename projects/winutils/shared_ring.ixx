@@ -0,0 +1,250 @@
+module;
+
+#include <Windows.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <format>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+export module shared_ring;
+
+import winutils;
+
+export struct shared_ring_error : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+namespace shared_ring
+{
+	constexpr uint32_t magic = 0x52535352;  // RSSR
+	constexpr uint32_t version = 1;
+	constexpr size_t alignment = 4096;
+
+	// Start of the mapping, followed by the slot sizes and the slots, each aligned to a page.
+	struct header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint64_t slot_count;
+		uint64_t slot_size;
+		std::atomic<uint64_t> head;  // next slot to write, advanced by the writer
+		std::atomic<uint64_t> tail;  // next slot to read, advanced by the reader
+		std::atomic<uint32_t> closed;
+	};
+
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "Header is shared between processes.");
+
+	constexpr size_t align(size_t size) { return (size + alignment - 1) / alignment * alignment; }
+
+	constexpr size_t slots_offset(size_t slot_count) { return align(sizeof(header) + slot_count * sizeof(uint64_t)); }
+
+	// Counts free slots, the writer waits on it.
+	std::string free_name(const std::string &name) { return name + "-free"; }
+
+	// Counts written slots, plus one when closed. The reader waits on it.
+	std::string filled_name(const std::string &name) { return name + "-filled"; }
+
+	using handle = win::unique_data<HANDLE, win::CloseHandle, INVALID_HANDLE_VALUE>;
+	using view = win::unique_data<void *, UnmapViewOfFile, nullptr>;
+}
+
+/// <summary>
+/// Writing end of a ring of frame slots in named shared memory, read by another process with <see cref="shared_ring_reader"/>.
+/// Frames are copied once into the mapping instead of through a pipe, and the writer only waits when all slots are in use.
+/// </summary>
+export class shared_ring_writer
+{
+private:
+	shared_ring::handle _mapping;
+	shared_ring::handle _free;
+	shared_ring::handle _filled;
+	shared_ring::view _view;
+	shared_ring::header *_header = nullptr;
+
+public:
+	shared_ring_writer(const std::string &name, size_t slot_count, size_t slot_size);
+
+	// Lets the reader finish.
+	~shared_ring_writer() { close(); }
+
+	shared_ring_writer(const shared_ring_writer &) = delete;
+	shared_ring_writer &operator=(const shared_ring_writer &) = delete;
+
+	/// <summary>
+	/// Copy a frame into the next slot, waiting for one to be free. Throws if <paramref name="reader"/> exits meanwhile.
+	/// </summary>
+	void write(std::span<const std::byte> frame, HANDLE reader);
+
+	/// <summary>
+	/// No more frames, the reader stops once it read the written ones.
+	/// </summary>
+	void close() noexcept;
+
+private:
+	uint64_t *sizes() { return reinterpret_cast<uint64_t *>(_header + 1); }
+
+	std::byte *slot(uint64_t index)
+	{
+		return static_cast<std::byte *>(static_cast<void *>(_view)) + shared_ring::slots_offset(_header->slot_count) + index * _header->slot_size;
+	}
+};
+
+/// <summary>
+/// Reading end of a <see cref="shared_ring_writer"/>, opened by name.
+/// </summary>
+export class shared_ring_reader
+{
+private:
+	shared_ring::handle _mapping;
+	shared_ring::handle _free;
+	shared_ring::handle _filled;
+	shared_ring::view _view;
+	shared_ring::header *_header = nullptr;
+
+public:
+	explicit shared_ring_reader(const std::string &name);
+
+	shared_ring_reader(const shared_ring_reader &) = delete;
+	shared_ring_reader &operator=(const shared_ring_reader &) = delete;
+
+	/// <summary>
+	/// Wait for the next frame, which stays valid until <see cref="release"/>.
+	/// Returns false once the ring is closed and empty, or if <paramref name="writer"/> exits.
+	/// </summary>
+	bool read(std::span<const std::byte> &frame, HANDLE writer);
+
+	/// <summary>
+	/// Hand the slot of the frame returned by <see cref="read"/> back to the writer.
+	/// </summary>
+	void release();
+
+private:
+	uint64_t *sizes() { return reinterpret_cast<uint64_t *>(_header + 1); }
+
+	std::byte *slot(uint64_t index)
+	{
+		return static_cast<std::byte *>(static_cast<void *>(_view)) + shared_ring::slots_offset(_header->slot_count) + index * _header->slot_size;
+	}
+};
+
+shared_ring_writer::shared_ring_writer(const std::string &name, size_t slot_count, size_t slot_size)
+{
+	using namespace shared_ring;
+
+	slot_size = align(slot_size);
+	uint64_t mapping_size = slots_offset(slot_count) + uint64_t(slot_count) * slot_size;
+
+	try
+	{
+		_mapping = win::CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+										   DWORD(mapping_size >> 32), DWORD(mapping_size), name.c_str());
+
+		if (GetLastError() == ERROR_ALREADY_EXISTS)
+		{
+			throw shared_ring_error("Shared memory already in use.");
+		}
+
+		_view = win::MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+		_free = win::CreateSemaphoreA(NULL, LONG(slot_count), LONG(slot_count), free_name(name).c_str());
+		_filled = win::CreateSemaphoreA(NULL, 0, LONG(slot_count) + 1, filled_name(name).c_str());
+	}
+	catch (std::exception &)
+	{
+		std::throw_with_nested(shared_ring_error(std::format("Could not create shared memory '{}'.", name)));
+	}
+
+	// Fresh mappings are zeroed. The reader is started after this, so no need to order the writes.
+	_header = static_cast<header *>(static_cast<void *>(_view));
+	_header->slot_count = slot_count;
+	_header->slot_size = slot_size;
+	_header->version = version;
+	_header->magic = magic;
+}
+
+void shared_ring_writer::write(std::span<const std::byte> frame, HANDLE reader)
+{
+	if (frame.size() > _header->slot_size)
+		throw std::length_error("Frame does not fit into shared memory slot.");
+
+	HANDLE handles[] = { _free, reader };
+
+	if (win::WaitForMultipleObjects(DWORD(std::size(handles)), handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+	{
+		throw shared_ring_error("Frame reader exited.");
+	}
+
+	uint64_t head = _header->head.load(std::memory_order_relaxed);
+	uint64_t index = head % _header->slot_count;
+
+	std::memcpy(slot(index), frame.data(), frame.size());
+	sizes()[index] = frame.size();
+
+	_header->head.store(head + 1, std::memory_order_release);
+	win::ReleaseSemaphore(_filled, 1, NULL);
+}
+
+void shared_ring_writer::close() noexcept
+{
+	if (_header == nullptr || _header->closed.exchange(1) != 0)
+		return;
+
+	// Unchecked, there is nothing to do about it failing and the reader also watches this process.
+	ReleaseSemaphore(_filled, 1, NULL);
+}
+
+shared_ring_reader::shared_ring_reader(const std::string &name)
+{
+	using namespace shared_ring;
+
+	try
+	{
+		_mapping = win::OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, name.c_str());
+		_view = win::MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+		_free = win::OpenSemaphoreA(SEMAPHORE_MODIFY_STATE | SYNCHRONIZE, FALSE, free_name(name).c_str());
+		_filled = win::OpenSemaphoreA(SEMAPHORE_MODIFY_STATE | SYNCHRONIZE, FALSE, filled_name(name).c_str());
+	}
+	catch (std::exception &)
+	{
+		std::throw_with_nested(shared_ring_error(std::format("Could not open shared memory '{}'.", name)));
+	}
+
+	_header = static_cast<header *>(static_cast<void *>(_view));
+
+	if (_header->magic != magic || _header->version != version)
+	{
+		throw shared_ring_error(std::format("Shared memory '{}' has an unknown layout.", name));
+	}
+}
+
+bool shared_ring_reader::read(std::span<const std::byte> &frame, HANDLE writer)
+{
+	HANDLE handles[] = { _filled, writer };
+
+	if (win::WaitForMultipleObjects(DWORD(std::size(handles)), handles, FALSE, INFINITE) != WAIT_OBJECT_0)
+		return false;
+
+	uint64_t tail = _header->tail.load(std::memory_order_relaxed);
+
+	// Woken without a frame, so closed.
+	if (tail == _header->head.load(std::memory_order_acquire))
+		return false;
+
+	uint64_t index = tail % _header->slot_count;
+	frame = { slot(index), size_t(sizes()[index]) };
+
+	return true;
+}
+
+void shared_ring_reader::release()
+{
+	_header->tail.fetch_add(1, std::memory_order_relaxed);
+	win::ReleaseSemaphore(_free, 1, NULL);
+}
@@ -193,14 +193,18 @@ namespace win
 
 EXPORT_CHECKED(CreatePipe, EQUAL_TO(TRUE));
 EXPORT_CHECKED(SetHandleInformation, EQUAL_TO(TRUE));
+EXPORT_CHECKED(DuplicateHandle, EQUAL_TO(TRUE));
 EXPORT_CHECKED(CreateFileA, NOT_EQUAL_TO(INVALID_HANDLE_VALUE));
 EXPORT_CHECKED(CreateProcessA, EQUAL_TO(TRUE));
+EXPORT_CHECKED(InitializeProcThreadAttributeList, EQUAL_TO(TRUE));
+EXPORT_CHECKED(UpdateProcThreadAttribute, EQUAL_TO(TRUE));
 EXPORT_CHECKED(WriteFile, EQUAL_TO(TRUE));
 EXPORT_CHECKED(WaitForSingleObject, NOT_EQUAL_TO(WAIT_FAILED));
 EXPORT_CHECKED(GetExitCodeProcess, EQUAL_TO(TRUE));
 EXPORT_CHECKED(CreateEventA, NOT_EQUAL_TO(0));
 EXPORT_CHECKED(CreateNamedPipeA, NOT_EQUAL_TO(INVALID_HANDLE_VALUE));
 EXPORT_CHECKED(SetEvent, EQUAL_TO(TRUE));
+EXPORT_CHECKED(ResetEvent, EQUAL_TO(TRUE));
 EXPORT_CHECKED(ConnectNamedPipe, NOT_EQUAL_TO(0));
 EXPORT_CHECKED(DisconnectNamedPipe, NOT_EQUAL_TO(0));
 EXPORT_CHECKED(GetOverlappedResult, NOT_EQUAL_TO(0));
@@ -209,3 +213,13 @@ EXPORT_CHECKED(WaitForMultipleObjects, NOT_EQUAL_TO(WAIT_FAILED));
 EXPORT_CHECKED(ReadFile, NOT_EQUAL_TO(FALSE));
 EXPORT_CHECKED(SetNamedPipeHandleState, NOT_EQUAL_TO(FALSE));
 EXPORT_CHECKED(WaitNamedPipeA, NOT_EQUAL_TO(FALSE));
+EXPORT_CHECKED(CreateFileMappingA, NOT_EQUAL_TO(0));
+EXPORT_CHECKED(OpenFileMappingA, NOT_EQUAL_TO(0));
+EXPORT_CHECKED(MapViewOfFile, NOT_EQUAL_TO(nullptr));
+EXPORT_CHECKED(CreateSemaphoreA, NOT_EQUAL_TO(0));
+EXPORT_CHECKED(OpenSemaphoreA, NOT_EQUAL_TO(0));
+EXPORT_CHECKED(ReleaseSemaphore, EQUAL_TO(TRUE));
+EXPORT_CHECKED(OpenProcess, NOT_EQUAL_TO(0));
+EXPORT_CHECKED(MoveFileExA, NOT_EQUAL_TO(FALSE));
+EXPORT_CHECKED(VirtualAlloc, NOT_EQUAL_TO(nullptr));
+EXPORT_CHECKED(SetFileInformationByHandle, NOT_EQUAL_TO(FALSE));
@@ -11,6 +11,11 @@ float4 PS_Stream(float4 position : SV_Position, float2 texcoord : TEXCOORD) : SV
 
 // Then, use the 'STREAM' macro from 'Stream.fxh' to generate the rest.
 // Arguments: name = STREAM_Example, shader = PS_Stream, pixel_format = RGBA8
+// Supported pixel formats: RGBA8, RGB10A2, RGBA16, RGBA16F, RGBA32F, R8, R16, R32F (float formats need FFmpeg 6.0+).
 STREAM(STREAM_Example, PS_Stream, RGBA8);
 
+// To read back less data, 'STREAM_YUV' converts to yuv420p and scales to the given size on the GPU.
+// Arguments: name, shader, width, height (both even).
+STREAM_YUV(STREAM_ExampleHalf, PS_Stream, BUFFER_WIDTH / 4 * 2, BUFFER_HEIGHT / 4 * 2);
+
 // Alternatively, check out 'Stream.fxh' for how it implement it yourself.
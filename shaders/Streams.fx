@@ -8,13 +8,16 @@ namespace Streams {
     texture STREAM_Color { Width = BUFFER_WIDTH; Height = BUFFER_HEIGHT; Format = RGBA8; };
     texture STREAM_Depth { Width = BUFFER_WIDTH; Height = BUFFER_HEIGHT; Format = RGBA8; };
     texture STREAM_Normals { Width = BUFFER_WIDTH; Height = BUFFER_HEIGHT; Format = RGBA8; };
+    // Linearized depth at full precision, recorded natively or converted to gray16 by the addon.
+    texture STREAM_DepthFloat { Width = BUFFER_WIDTH; Height = BUFFER_HEIGHT; Format = R32F; };
 
     sampler Preview_Color { Texture = STREAM_Color; };
     sampler Preview_Depth { Texture = STREAM_Depth; };
     sampler Preview_Normals { Texture = STREAM_Normals; };
+    sampler Preview_DepthFloat { Texture = STREAM_DepthFloat; };
 
     // Preview Options.
-    UI_COMBO(iUIPreview, "Preview", "Draw the selected stream to the screen.", 0, 3, 0, "Off\0Color\0Depth\0Normals\0")
+    UI_COMBO(iUIPreview, "Preview", "Draw the selected stream to the screen.", 0, 4, 0, "Off\0Color\0Depth\0Normals\0Depth (Float)\0")
 
     // Depth Options.
     CAT_BOOL(bUIRgbDepth, "Depth Options", "Full RGB", "Display depth using full RGB spectrum.", false)
@@ -109,11 +112,13 @@ namespace Streams {
     void PS_Stream(in float4 position : SV_Position, in float2 texcoord : TEXCOORD,
                    out float4 bbTgt : SV_Target0,
                    out float4 depthTgt : SV_Target1,
-                   out float4 normalTgt : SV_Target2)
+                   out float4 normalTgt : SV_Target2,
+                   out float depthFloatTgt : SV_Target3)
     {
         bbTgt = float4(tex2D(ReShade::BackBuffer, texcoord).rgb, 1.0);
         depthTgt = float4(GetDepth(texcoord).rgb, 1.0);
         normalTgt = float4(GetScreenSpaceNormal(texcoord).rgb, 1.0);
+        depthFloatTgt = GetLinearizedDepth(texcoord);
     }
 
     float3 PS_Preview(float4 position : SV_Position, float2 texcoord : TEXCOORD) : SV_Target
@@ -128,6 +133,8 @@ namespace Streams {
             return tex2D(Preview_Depth, texcoord).rgb;
         case 3:
             return tex2D(Preview_Normals, texcoord).rgb;
+        case 4:
+            return tex2D(Preview_DepthFloat, texcoord).rrr;
         }
     }
 
@@ -139,6 +146,7 @@ namespace Streams {
             RenderTarget0 = STREAM_Color;
             RenderTarget1 = STREAM_Depth;
             RenderTarget2 = STREAM_Normals;
+            RenderTarget3 = STREAM_DepthFloat;
         }
         pass preview {
             VertexShader = PostProcessVS;